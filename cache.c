@@ -1,18 +1,60 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "cache.h"
+#include "trace.h"
+#include "mrc.h"
+
+// Every shared segment starts with this value once its creator has initialized it
+#define CACHE_SHARED_MAGIC 0x4a424f44u
+
+// One set of a shared cache: a block can only live in the set its key hashes to,
+// so processes touching different sets never contend
+typedef struct {
+    pthread_mutex_t lock;
+    int clock;
+    cache_entry_t entries[CACHE_SHARED_WAYS];
+} cache_set_t;
+
+typedef struct {
+    _Atomic uint32_t magic;
+    int num_sets;
+    cache_set_t sets[];
+} shared_cache_t;
+
+// The entries that may hold a given block, with the clock that orders them and the set lock held, if any
+typedef struct {
+    cache_entry_t *entries;
+    int num_entries;
+    int *clock;
+    cache_set_t *set;
+} cache_slots_t;
 
 static cache_entry_t *cache = NULL;
 static int cache_size = 0;
-static int clock = 0;
+static int cache_clock = 0;
 static int num_queries = 0;
 static int num_hits = 0;
+// Hits on blocks another process put in the shared cache
+static int num_shared_hits = 0;
+
+// The attached shared segment and its mapped size, or NULL in private mode
+static shared_cache_t *shared = NULL;
+static size_t shared_size = 0;
+// This process, as recorded in the owner of the shared entries it fills
+static int self = 0;
 
 int cache_create(int num_entries) {
     // Check if the cache has already created, or the requested number of entries is out of bounds
-    if (cache != NULL || num_entries < 2 || num_entries > 4096) {
+    if (cache != NULL || shared != NULL || num_entries < 2 || num_entries > 4096) {
         return -1;
     }
     // Dynamically allocate memory for the cache entries based on the requested number of entries
@@ -26,12 +68,114 @@ int cache_create(int num_entries) {
     // Initialize each cache entry as invalid as empty
     for (int i = 0; i < cache_size; i++) {
         cache[i].valid = false;
+        cache[i].pin_count = 0;
+    }
+    return 1;
+
+}
+
+static size_t shared_bytes(int num_sets) {
+    return sizeof(shared_cache_t) + num_sets * sizeof(cache_set_t);
+}
+
+// Sets up the locks and empty entries of a segment nobody else can see yet
+static int shared_init(shared_cache_t *segment, int num_sets) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    // Recursive, so the cache functions can run under cache_block_lock
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    // Robust, so a process that dies holding a lock does not wedge the others
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    segment->num_sets = num_sets;
+    for (int s = 0; s < num_sets; s++) {
+        if (pthread_mutex_init(&segment->sets[s].lock, &attr) != 0) {
+            pthread_mutexattr_destroy(&attr);
+            return -1;
+        }
+        segment->sets[s].clock = 0;
+        for (int i = 0; i < CACHE_SHARED_WAYS; i++) {
+            segment->sets[s].entries[i].valid = false;
+            segment->sets[s].entries[i].pin_count = 0;
+        }
+    }
+    pthread_mutexattr_destroy(&attr);
+    atomic_store(&segment->magic, CACHE_SHARED_MAGIC);
+    return 1;
+}
+
+int cache_create_shared(const char *name, int num_entries) {
+    if (cache != NULL || shared != NULL || num_entries < 2 || num_entries > 4096) {
+        return -1;
+    }
+    int num_sets = (num_entries + CACHE_SHARED_WAYS - 1) / CACHE_SHARED_WAYS;
+    size_t size = shared_bytes(num_sets);
+
+    // Exactly one process wins the exclusive create and initializes the segment
+    bool creator = true;
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd == -1 && errno == EEXIST) {
+        creator = false;
+        fd = shm_open(name, O_RDWR, S_IRUSR | S_IWUSR);
+    }
+    if (fd == -1) {
+        return -1;
     }
+    if (creator && ftruncate(fd, size) == -1) {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    if (!creator) {
+        // Wait for the creator to size the segment, then take its geometry rather than ours
+        struct stat st;
+        do {
+            if (fstat(fd, &st) == -1) {
+                close(fd);
+                return -1;
+            }
+        } while (st.st_size == 0 && usleep(1000) == 0);
+        size = st.st_size;
+    }
+    shared_cache_t *segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        return -1;
+    }
+    if (creator) {
+        if (shared_init(segment, num_sets) != 1) {
+            munmap(segment, size);
+            shm_unlink(name);
+            return -1;
+        }
+    } else {
+        while (atomic_load(&segment->magic) != CACHE_SHARED_MAGIC) {
+            usleep(1000);
+        }
+        if (shared_bytes(segment->num_sets) != size) {
+            munmap(segment, size);
+            return -1;
+        }
+    }
+    shared = segment;
+    shared_size = size;
+    self = getpid();
+    cache_size = segment->num_sets * CACHE_SHARED_WAYS;
     return 1;
+}
 
+int cache_unlink_shared(const char *name) {
+    return shm_unlink(name) == 0 ? 1 : -1;
 }
 
 int cache_destroy(void) {
+    // Detach from a shared cache, which lives on for the other processes
+    if (shared != NULL) {
+        munmap(shared, shared_size);
+        shared = NULL;
+        cache_size = 0;
+        return 1;
+    }
     // Check if the cache has already been destroyed
     if (cache == NULL) {
         return -1;
@@ -40,112 +184,323 @@ int cache_destroy(void) {
     free(cache);
     // Reset the cache pointer to NULL
     cache = NULL;
+    cache_size = 0;
+    return 1;
+}
+
+static void lock_set(cache_set_t *set) {
+    // The previous owner died mid-operation; its set holds at worst a stale or missing block
+    if (pthread_mutex_lock(&set->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&set->lock);
+    }
+}
+
+// Consecutive blocks go to consecutive sets, so a device no larger than the cache never conflicts
+static cache_set_t *set_of(int disk_num, int block_num) {
+    uint64_t key = (uint64_t)disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num;
+    return &shared->sets[key % shared->num_sets];
+}
+
+// Narrows a search for |disk_num| and |block_num| down to the entries that may hold the block:
+// the whole array in private mode, its locked set in shared mode
+static cache_slots_t slots_for(int disk_num, int block_num) {
+    cache_slots_t slots = { cache, cache_size, &cache_clock, NULL };
+    if (shared != NULL) {
+        slots.set = set_of(disk_num, block_num);
+        lock_set(slots.set);
+        slots.entries = slots.set->entries;
+        slots.num_entries = CACHE_SHARED_WAYS;
+        slots.clock = &slots.set->clock;
+    }
+    return slots;
+}
+
+static void release(cache_slots_t *slots) {
+    if (slots->set != NULL) {
+        pthread_mutex_unlock(&slots->set->lock);
+    }
+}
+
+static cache_entry_t *find(cache_slots_t *slots, int disk_num, int block_num) {
+    for (int i = 0; i < slots->num_entries; i++) {
+        cache_entry_t *entry = &slots->entries[i];
+        // Check if the cache entry is valid and the disk number and block number match
+        if (entry->valid && entry->disk_num == disk_num && entry->block_num == block_num) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Places a block known not to be cached into a free entry, or over the least recently used one that is not pinned
+static int insert_into(cache_slots_t *slots, int disk_num, int block_num, const uint8_t *buf) {
+    // Track the least recently used cache entry that is not pinned
+    cache_entry_t *victim = NULL;
+    // Initialize the minimum access time to the current clock
+    int min_access_time = *slots->clock;
+    for (int i = 0; i < slots->num_entries; i++) {
+        cache_entry_t *entry = &slots->entries[i];
+        // A pinned entry stays put even once invalid, since someone is still reading it
+        if (entry->pin_count > 0) {
+            continue;
+        }
+        // Check if the cache entry is invalid
+        if (!entry->valid) {
+            victim = entry;
+            break;
+        }
+        // Check if the access time is less than the minimum access time
+        if (entry->access_time < min_access_time) {
+            // Update the least recently used cache entry
+            victim = entry;
+            // Update the minimum access time
+            min_access_time = entry->access_time;
+        }
+    }
+    // Fail if every entry is pinned
+    if (victim == NULL) {
+        return -1;
+    }
+    // Update the disk number and block number of the cache entry
+    victim->valid = true;
+    victim->disk_num = disk_num;
+    victim->block_num = block_num;
+    // Copy the block data into the cache entry
+    memcpy(victim->block, buf, JBOD_BLOCK_SIZE);
+    victim->owner = self;
+    // Update the access time of the cache entry
+    victim->access_time = (*slots->clock)++;
     return 1;
 }
 
 int cache_lookup(int disk_num, int block_num, uint8_t *buf) {
     // Check if the cache has not been created
-    if (cache == NULL) {
+    if (!cache_enabled()) {
         return -1;
     }
     // Check if the buffer is NULL
     if (buf == NULL) {
         return -1;
     }
+    uint64_t t0 = TRACE_START();
     // Increment the number of queries
     ++num_queries;
-    // Iterate through the cache entries
-    for (int i = 0; i < cache_size; i++) {
-        // Check if the cache entry is valid and the disk number and block number match
-        if (cache[i].valid && cache[i].disk_num == disk_num && cache[i].block_num == block_num) {
-            // Increment the number of hits
-            ++num_hits;
-            // Copy the block data into the buffer
-            if (buf != NULL) {
-                memcpy(buf, cache[i].block, JBOD_BLOCK_SIZE);
-            }
-            // Update the access time of the cache entry
-            cache[i].access_time = clock++;
-            return 1;
+    // Feed the query to the miss ratio curve estimator
+    if (mrc_enabled()) {
+        mrc_reference(disk_num, block_num);
+    }
+    cache_slots_t slots = slots_for(disk_num, block_num);
+    cache_entry_t *entry = find(&slots, disk_num, block_num);
+    if (entry != NULL) {
+        // Increment the number of hits
+        ++num_hits;
+        if (shared != NULL && entry->owner != self) {
+            ++num_shared_hits;
         }
+        // Copy the block data into the buffer
+        memcpy(buf, entry->block, JBOD_BLOCK_SIZE);
+        // Update the access time of the cache entry
+        entry->access_time = (*slots.clock)++;
     }
-    return -1;
+    release(&slots);
+    TRACE_END(TRACE_CACHE_LOOKUP, entry != NULL, disk_num, block_num, t0);
+    return entry != NULL ? 1 : -1;
 }
 
 void cache_update(int disk_num, int block_num, const uint8_t *buf) {
-    if (cache == NULL) {
+    if (!cache_enabled()) {
         return;
     }
     if (buf == NULL) {
         return;
     }
-    for (int i = 0; i < cache_size; ++i) {
-        // Check if the cache entry is valid and the disk number and block number match
-        if (cache[i].valid && cache[i].disk_num == disk_num && cache[i].block_num == block_num) {
-            // Copy the block data into the cache entry
-            memcpy(cache[i].block, buf, JBOD_BLOCK_SIZE);
-            // Update the access time of the cache entry
-            cache[i].access_time = clock++;
+    uint64_t t0 = TRACE_START();
+    cache_slots_t slots = slots_for(disk_num, block_num);
+    cache_entry_t *entry = find(&slots, disk_num, block_num);
+    if (entry != NULL && entry->pin_count == 0) {
+        // Copy the block data into the cache entry
+        memcpy(entry->block, buf, JBOD_BLOCK_SIZE);
+        entry->owner = self;
+        // Update the access time of the cache entry
+        entry->access_time = (*slots.clock)++;
+    } else if (entry != NULL) {
+        // Someone is still copying out of the old contents, so retire that entry and cache a new copy
+        entry->valid = false;
+        insert_into(&slots, disk_num, block_num, buf);
+    }
+    release(&slots);
+    TRACE_END(TRACE_CACHE_UPDATE, 0, disk_num, block_num, t0);
+}
+
+void cache_invalidate(int disk_num, int block_num) {
+    if (!cache_enabled()) {
+        return;
+    }
+    if (mrc_enabled()) {
+        mrc_invalidate(disk_num, block_num);
+    }
+    cache_slots_t slots = slots_for(disk_num, block_num);
+    cache_entry_t *entry = find(&slots, disk_num, block_num);
+    if (entry != NULL) {
+        entry->valid = false;
+    }
+    release(&slots);
+}
+
+void cache_invalidate_all(void) {
+    if (!cache_enabled()) {
+        return;
+    }
+    if (mrc_enabled()) {
+        mrc_invalidate_all();
+    }
+    if (shared != NULL) {
+        for (int s = 0; s < shared->num_sets; s++) {
+            cache_set_t *set = &shared->sets[s];
+            lock_set(set);
+            for (int i = 0; i < CACHE_SHARED_WAYS; i++) {
+                set->entries[i].valid = false;
+            }
+            pthread_mutex_unlock(&set->lock);
+        }
+        return;
+    }
+    for (int i = 0; i < cache_size; i++) {
+        cache[i].valid = false;
+    }
+}
+
+const uint8_t *cache_pin(int disk_num, int block_num) {
+    // Check if the cache has not been created
+    if (!cache_enabled()) {
+        return NULL;
+    }
+    uint64_t t0 = TRACE_START();
+    // Increment the number of queries
+    ++num_queries;
+    // Feed the query to the miss ratio curve estimator
+    if (mrc_enabled()) {
+        mrc_reference(disk_num, block_num);
+    }
+    cache_slots_t slots = slots_for(disk_num, block_num);
+    cache_entry_t *entry = find(&slots, disk_num, block_num);
+    if (entry != NULL) {
+        // Increment the number of hits
+        ++num_hits;
+        if (shared != NULL && entry->owner != self) {
+            ++num_shared_hits;
+        }
+        // Update the access time of the cache entry
+        entry->access_time = (*slots.clock)++;
+        // Hold the entry in place until the caller is done with the block
+        ++entry->pin_count;
+    }
+    release(&slots);
+    TRACE_END(TRACE_CACHE_PIN, entry != NULL, disk_num, block_num, t0);
+    return entry != NULL ? entry->block : NULL;
+}
+
+void cache_unpin(const uint8_t *block) {
+    if (!cache_enabled() || block == NULL) {
+        return;
+    }
+    if (shared != NULL) {
+        // The block lives inside an entry of a set, so both indexes follow from the pointer
+        int s = (block - (const uint8_t *)shared->sets) / sizeof(cache_set_t);
+        if (s < 0 || s >= shared->num_sets) {
             return;
         }
+        cache_set_t *set = &shared->sets[s];
+        int i = (block - set->entries[0].block) / sizeof(cache_entry_t);
+        lock_set(set);
+        if (i >= 0 && i < CACHE_SHARED_WAYS && set->entries[i].pin_count > 0) {
+            --set->entries[i].pin_count;
+        }
+        pthread_mutex_unlock(&set->lock);
+        return;
+    }
+    // The block lives inside its entry, so the entry index follows from the pointer
+    int i = (block - cache[0].block) / sizeof(cache_entry_t);
+    if (i >= 0 && i < cache_size && cache[i].pin_count > 0) {
+        --cache[i].pin_count;
     }
 }
 
 int cache_insert(int disk_num, int block_num, const uint8_t *buf) {
-    if (cache == NULL) {
+    if (!cache_enabled()) {
         return -1;
     }
     if (buf == NULL) {
         return -1;
     }
     // Check if the disk number is within bounds
-    if (disk_num < 0 || disk_num >= JBOD_NUM_DISKS) {
+    // The disk number is device-wide, so a multi-enclosure device has more than JBOD_NUM_DISKS of them
+    if (disk_num < 0) {
         return -1;
     }
     // Check if the block number is within bounds
     if (block_num < 0 || block_num >= JBOD_NUM_BLOCKS_PER_DISK) {
         return -1;
     }
-    for (int i = 0; i < cache_size; i++) {
-        // Check if the cache entry is valid and the disk number and block number match
-        if (cache[i].valid && cache[i].disk_num == disk_num && cache[i].block_num == block_num) {
-            return -1;
-        }
+    uint64_t t0 = TRACE_START();
+    cache_slots_t slots = slots_for(disk_num, block_num);
+    // Fail if the block is already cached, otherwise place it
+    int rc = -1;
+    if (find(&slots, disk_num, block_num) == NULL) {
+        rc = insert_into(&slots, disk_num, block_num, buf);
     }
-    // Track the least recently used cache entry
-    int lru_index = 0;
-    // Initialize the minimum access time to the current clock
-    int min_access_time = clock;
-    for (int i = 0; i < cache_size; i++) {
-        // Check if the cache entry is invalid
-        if (!cache[i].valid) {
-            // Copy the block data into the cache entry
-            cache[i].valid = true;
-            cache[i].disk_num = disk_num;
-            cache[i].block_num = block_num;
-            memcpy(cache[i].block, buf, JBOD_BLOCK_SIZE);
-            // Update the access time of the cache entry
-            cache[i].access_time = clock++;
-            return 1;
-        }
-        // Check if the access time is less than the minimum access time
-        if (cache[i].access_time < min_access_time) {
-            // Update the least recently used cache entry
-            lru_index = i;
-            // Update the minimum access time
-            min_access_time = cache[i].access_time;
-        }
+    release(&slots);
+    TRACE_END(TRACE_CACHE_INSERT, rc == 1, disk_num, block_num, t0);
+    return rc;
+}
+
+// Consecutive blocks map to consecutive sets, wrapping around at the last one
+// Locking them in ascending set order keeps two processes locking overlapping ranges from deadlocking
+static void range_sets(int disk_num, int block_num, int count, int *first, int *last, int *wrapped) {
+    int num_sets = shared->num_sets;
+    uint64_t key = (uint64_t)disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num;
+    if (count >= num_sets) {
+        *first = 0;
+        *last = num_sets - 1;
+        *wrapped = -1;
+        return;
+    }
+    *first = key % num_sets;
+    *last = (key + count - 1) % num_sets;
+    // The sets from 0 up to *wrapped come before the range that starts at *first
+    *wrapped = -1;
+    if (*last < *first) {
+        *wrapped = *last;
+        *last = num_sets - 1;
+    }
+}
+
+void cache_block_lock(int disk_num, int block_num, int count) {
+    if (shared == NULL || count <= 0) {
+        return;
+    }
+    int first, last, wrapped;
+    range_sets(disk_num, block_num, count, &first, &last, &wrapped);
+    for (int s = 0; s <= wrapped; s++) {
+        lock_set(&shared->sets[s]);
+    }
+    for (int s = first; s <= last; s++) {
+        lock_set(&shared->sets[s]);
+    }
+}
+
+void cache_block_unlock(int disk_num, int block_num, int count) {
+    if (shared == NULL || count <= 0) {
+        return;
+    }
+    int first, last, wrapped;
+    range_sets(disk_num, block_num, count, &first, &last, &wrapped);
+    for (int s = first; s <= last; s++) {
+        pthread_mutex_unlock(&shared->sets[s].lock);
+    }
+    for (int s = 0; s <= wrapped; s++) {
+        pthread_mutex_unlock(&shared->sets[s].lock);
     }
-    // Evict the least recently used cache entry
-    cache[lru_index].valid = true;
-    // Update the disk number and block number of the cache entry
-    cache[lru_index].disk_num = disk_num;
-    cache[lru_index].block_num = block_num;
-    // Copy the block data into the cache entry
-    memcpy(cache[lru_index].block, buf, JBOD_BLOCK_SIZE);
-    // Update the access time of the cache entry
-    cache[lru_index].access_time = clock++;
-    return 1;
 }
 
 bool cache_enabled(void) {
@@ -158,6 +513,18 @@ bool cache_enabled(void) {
     }
 }
 
+float cache_hit_rate(void) {
+  return 100 * (float) num_hits / num_queries;
+}
+
+float cache_shared_hit_rate(void) {
+  return 100 * (float) num_shared_hits / num_queries;
+}
+
 void cache_print_hit_rate(void) {
-  fprintf(stderr, "Hit rate: %5.1f%%\n", 100 * (float) num_hits / num_queries);
+  fprintf(stderr, "Hit rate: %5.1f%%\n", cache_hit_rate());
+  // Still reported after cache_destroy has detached
+  if (self != 0) {
+    fprintf(stderr, "Hits on other processes' blocks: %5.1f%%\n", cache_shared_hit_rate());
+  }
 }
@@ -13,6 +13,8 @@ typedef struct {
   int block_num;
   uint8_t block[JBOD_BLOCK_SIZE];
   int access_time;
+  int pin_count;
+  int owner;            /* process that cached the contents, in a shared cache */
 } cache_entry_t;
 
 /* Returns 1 on success and -1 on failure. Should allocate a space for
@@ -20,10 +22,30 @@ typedef struct {
  * without first calling cache_destroy (see below) should fail. */
 int cache_create(int num_entries);
 
+/* Entries per set of a shared cache */
+#define CACHE_SHARED_WAYS 8
+
+/* Returns 1 on success and -1 on failure. Like cache_create, but the entries
+ * live in the named shared-memory segment |name|, so every process that
+ * creates a cache with the same name shares the same blocks: one process's
+ * miss becomes another's hit. The first process creates the segment with
+ * |num_entries| entries, rounded up to whole sets of CACHE_SHARED_WAYS; the
+ * others attach and keep its size. A block can only live in the set its key
+ * hashes to, and each set has its own process-shared lock. */
+int cache_create_shared(const char *name, int num_entries);
+
+/* Returns 1 on success and -1 on failure. Removes the segment |name|;
+ * processes still attached keep using it until they call cache_destroy. */
+int cache_unlink_shared(const char *name);
+
 /* Returns 1 on success and -1 on failure. Frees the space allocated by
- * cache_create function above. */
+ * cache_create function above, or detaches from a shared cache. */
 int cache_destroy(void);
 
+/* Blocks are identified by a device-wide |disk_num|, which counts the disks of
+ * every enclosure of the linear device in order, and the |block_num| within
+ * that disk. */
+
 /* Returns 1 on success and -1 on failure. Looks up the block located at
  * |disk_num| and |block_num| in cache. If |buf| is not NULL, copies the
  * contents to buf. */
@@ -33,15 +55,52 @@ int cache_lookup(int disk_num, int block_num, uint8_t *buf);
  * |block_num| into cache. If there is already an existing entry in the cache
  * with |disk_num| and |block_num|, should update its value with data provided
  * in |buf|, which cannot be NULL. If there cache is full, should evict least
- * recently used entry and insert the new entry. */
+ * recently used entry that is not pinned and insert the new entry; fails if
+ * every entry is pinned. */
 int cache_insert(int disk_num, int block_num, const uint8_t *buf);
 
 void cache_update(int disk_num, int block_num, const uint8_t *buf);
 
+/* Drops the cached copy of the block at |disk_num| and |block_num|, if any,
+ * e.g. because another client wrote it. A pinned copy stays readable until
+ * it is unpinned but is no longer found. */
+void cache_invalidate(int disk_num, int block_num);
+
+/* Drops every cached copy, e.g. because a mount reinitialized the JBOD.
+ * Processes sharing the cache lose their copies too. */
+void cache_invalidate_all(void);
+
+/* Returns a read-only pointer to the cached block located at |disk_num| and
+ * |block_num|, or NULL if it is not in cache. Counts as a lookup. The entry
+ * is pinned: it will not be evicted until the pointer is passed to
+ * cache_unpin, so callers can copy straight out of the cache. */
+const uint8_t *cache_pin(int disk_num, int block_num);
+
+/* Releases a pin taken by cache_pin on the entry holding |block|. An update
+ * of a pinned block leaves the pinned copy alone and caches a new one. */
+void cache_unpin(const uint8_t *block);
+
+/* Holds off every other process from the cached copies of the |count|
+ * consecutive blocks of |disk_num| starting at |block_num| until
+ * cache_block_unlock with the same arguments. Callers that pair a JBOD read
+ * or write with a cache insert or update hold it across both, so the cache
+ * never ends up with a copy the JBOD no longer has. The cache functions may
+ * be called in between; without a shared cache these do nothing. */
+void cache_block_lock(int disk_num, int block_num, int count);
+void cache_block_unlock(int disk_num, int block_num, int count);
+
 /* Returns true if cache is enabled and false if not. */
 bool cache_enabled(void);
 
-/* Prints the hit rate of the cache. */
+/* Returns the share of cache queries that hit, as a percentage. */
+float cache_hit_rate(void);
+
+/* Returns the share of cache queries that hit on a block another process
+ * sharing the cache put there, as a percentage; 0 for a private cache. */
+float cache_shared_hit_rate(void);
+
+/* Prints the hit rate of the cache, and for a shared cache the share of
+ * queries served by other processes' inserts. */
 void cache_print_hit_rate(void);
 
 #endif
@@ -0,0 +1,112 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "capture.h"
+
+/* Size of the buffer lines accumulate in before they are written out */
+#define CAPTURE_BUF_SIZE 65536
+
+/* Longest line capture_record can produce */
+#define CAPTURE_MAX_LINE 128
+
+static int capture_fd = -1;
+static uint64_t capture_epoch = 0;
+static char capture_buf[CAPTURE_BUF_SIZE];
+static uint32_t capture_used = 0;
+
+// Write the buffered lines to the capture file
+static int capture_flush(void) {
+    uint32_t written = 0;
+    while (written < capture_used) {
+        ssize_t n = write(capture_fd, capture_buf + written, capture_used - written);
+        if (n <= 0) {
+            return -1;
+        }
+        written += n;
+    }
+    capture_used = 0;
+    return 1;
+}
+
+// Append the decimal digits of |value| at |p| and return the position after them
+static char *put_u64(char *p, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (n > 0) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+uint64_t capture_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+bool capture_enabled(void) {
+    return capture_fd != -1;
+}
+
+int capture_start(const char *path) {
+    // Check if a capture is already running
+    if (capture_fd != -1) {
+        return -1;
+    }
+    capture_fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (capture_fd == -1) {
+        return -1;
+    }
+    capture_used = 0;
+    capture_epoch = capture_now();
+    return 1;
+}
+
+int capture_stop(void) {
+    // Check if there is a capture to stop
+    if (capture_fd == -1) {
+        return -1;
+    }
+    int rc = capture_flush();
+    close(capture_fd);
+    capture_fd = -1;
+    return rc;
+}
+
+void capture_record(const char *cmd, bool has_args, uint64_t addr, uint32_t len, uint32_t ch, uint64_t start) {
+    if (capture_fd == -1) {
+        return;
+    }
+    uint64_t end = capture_now();
+    // Make room for a full line first, so the line itself needs no checks
+    if (CAPTURE_BUF_SIZE - capture_used < CAPTURE_MAX_LINE && capture_flush() != 1) {
+        return;
+    }
+
+    char *p = capture_buf + capture_used;
+    size_t cmd_len = strlen(cmd);
+    memcpy(p, cmd, cmd_len);
+    p += cmd_len;
+    if (has_args) {
+        *p++ = ' ';
+        p = put_u64(p, addr);
+        *p++ = ' ';
+        p = put_u64(p, len);
+        *p++ = ' ';
+        p = put_u64(p, ch);
+    }
+    *p++ = ' ';
+    p = put_u64(p, start - capture_epoch);
+    *p++ = ' ';
+    p = put_u64(p, end - start);
+    *p++ = '\n';
+    capture_used = p - capture_buf;
+}
@@ -0,0 +1,39 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Records mdadm calls as lines of the traces/ text format, followed by two
+ * timing columns: the start time of the call in nanoseconds since the
+ * capture began, and its duration in nanoseconds. tester ignores extra
+ * columns, so a capture replays like any shipped trace. Lines accumulate in
+ * a buffer that is written out in large chunks, keeping the cost of a
+ * recorded call to a few hundred nanoseconds of formatting. */
+
+/* Returns 1 on success and -1 on failure. Starts recording to |path|,
+ * truncating it. Fails if a capture is already running. */
+int capture_start(const char *path);
+
+/* Returns 1 on success and -1 on failure. Flushes and closes the capture. */
+int capture_stop(void);
+
+/* Returns true while a capture is running. */
+bool capture_enabled(void);
+
+/* Returns the current time in nanoseconds, as passed to capture_record. */
+uint64_t capture_now(void);
+
+/* The fill column of a WRITE whose data is not one repeated byte. The trace
+ * format cannot describe such a write, so the capture marks it with a value
+ * no byte can take, and replay rejects the line rather than write the wrong
+ * data. */
+#define CAPTURE_MIXED_FILL 256
+
+/* Appends one line: |cmd| alone for MOUNT and UNMOUNT, or |cmd| with |addr|,
+ * |len| and the fill byte |ch| (or CAPTURE_MIXED_FILL) for READ and WRITE,
+ * followed by the timing columns of a call that started at |start| and ends
+ * now. */
+void capture_record(const char *cmd, bool has_args, uint64_t addr, uint32_t len, uint32_t ch, uint64_t start);
+
+#endif
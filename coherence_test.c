@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "cache.h"
+#include "jbod.h"
+#include "mdadm.h"
+#include "net.h"
+#include "coherence_test.h"
+
+#define COHERENCE_ARGUMENTS "hc:i:n:b:s:S:w:t:X:"
+#define USAGE                                                                 \
+  "USAGE: coherence_test [-h] [-c clients] [-i idle-clients] [-n ops] [-b blocks]\n" \
+  "                      [-s cache_size] [-S shm_name] [-w write-percent]\n"  \
+  "                      [-t tcp|unix] [-X capabilities]\n"                   \
+  "\n"                                                                        \
+  "where:\n"                                                                  \
+  "    -h - help mode (display this message)\n"                               \
+  "    -c - number of client processes (default 4)\n"                         \
+  "    -i - number of clients that read every hot block, stay idle while\n"  \
+  "         the others run, then read every hot block again (default 0)\n"  \
+  "    -n - reads and writes per client (default 20000)\n"                    \
+  "    -b - hot blocks the clients share, from the start of the device\n"    \
+  "         (default 64)\n"                                                   \
+  "    -s - entries of the private cache of each client (default 64)\n"      \
+  "    -S - have the clients share one cache of cache_size entries in this\n" \
+  "         shared-memory segment instead, created afresh\n"                \
+  "    -w - share of the operations that write, in percent (default 10)\n"   \
+  "    -t - transport to the server (default unix)\n"                        \
+  "    -X - use only these JBOD_CAP_* protocol extensions of the server\n"   \
+  "         (a bit mask, default all); without JBOD_CAP_INVALIDATE the\n"    \
+  "         caches go stale\n"                                               \
+  "\n"
+
+static bool connect_server(const char *transport) {
+  if (strcmp(transport, "tcp") == 0)
+    return jbod_connect(JBOD_SERVER, JBOD_PORT);
+  if (strcmp(transport, "unix") == 0)
+    return jbod_connect_unix(0, JBOD_UNIX_PATH);
+  errx(1, "Unknown transport %s; shared memory serves one client.", transport);
+}
+
+/* Fills |buf| with the stamp of a write */
+static void stamp_block(uint8_t *buf, uint32_t version, uint32_t writer) {
+  coherence_stamp_t stamp = { version, writer };
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i += sizeof(stamp))
+    memcpy(buf + i, &stamp, sizeof(stamp));
+}
+
+/* Reads hot block |b| as client |id|, checking it against the last
+ * completed write */
+static void check_read(uint32_t id, coherence_block_t *blocks, int b, coherence_result_t *result) {
+  uint8_t buf[JBOD_BLOCK_SIZE];
+
+  /* Any write that completed before the read starts must show */
+  uint32_t floor = atomic_load(&blocks[b].version);
+  if (mdadm_read((uint64_t)b * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf) == -1)
+    errx(1, "client %u: read of block %d failed", id, b);
+  ++result->reads;
+  coherence_stamp_t stamp;
+  memcpy(&stamp, buf, sizeof(stamp));
+  for (int i = sizeof(stamp); i < JBOD_BLOCK_SIZE; i += sizeof(stamp)) {
+    if (memcmp(buf + i, &stamp, sizeof(stamp)) != 0) {
+      ++result->torn;
+      break;
+    }
+  }
+  if (stamp.version < floor)
+    ++result->stale;
+}
+
+/* Runs |ops| random reads and writes of the hot blocks as client |id| */
+static void run_client(uint32_t id, coherence_block_t *blocks, int num_blocks, int ops,
+                       int write_pct, coherence_result_t *result) {
+  uint8_t buf[JBOD_BLOCK_SIZE];
+  unsigned int seed = id + 1;
+
+  for (int op = 0; op < ops; ++op) {
+    int b = rand_r(&seed) % num_blocks;
+    uint64_t addr = (uint64_t)b * JBOD_BLOCK_SIZE;
+
+    if (rand_r(&seed) % 100 < write_pct) {
+      /* Writes of a block are serialized, so their versions reach the JBOD in order */
+      pthread_mutex_lock(&blocks[b].lock);
+      uint32_t version = atomic_load(&blocks[b].version) + 1;
+      stamp_block(buf, version, id);
+      if (mdadm_write(addr, JBOD_BLOCK_SIZE, buf) == -1)
+        errx(1, "client %u: write of block %d failed", id, b);
+      atomic_store(&blocks[b].version, version);
+      pthread_mutex_unlock(&blocks[b].lock);
+      ++result->writes;
+      continue;
+    }
+    check_read(id, blocks, b, result);
+  }
+  result->hit_rate = cache_hit_rate();
+  result->shared_hit_rate = cache_shared_hit_rate();
+}
+
+/* Reads every hot block as client |id|, so the server pushes it the writes
+ * of the others, then does no I/O, and so drains nothing, until the parent
+ * clears |busy|, and reads every hot block again. A server that
+ * blocks on a full side channel hangs the others here; one that closes it
+ * must leave the client dropping its whole cache rather than going stale. */
+static void run_idle_client(uint32_t id, coherence_block_t *blocks, int num_blocks,
+                            _Atomic int *busy, coherence_result_t *result) {
+  for (int b = 0; b < num_blocks; ++b)
+    check_read(id, blocks, b, result);
+  while (atomic_load(busy) > 0)
+    usleep(1000);
+  for (int b = 0; b < num_blocks; ++b)
+    check_read(id, blocks, b, result);
+  result->hit_rate = cache_hit_rate();
+  result->shared_hit_rate = cache_shared_hit_rate();
+}
+
+int main(int argc, char *argv[]) {
+  int ch, rc, num_clients = 4, num_idle = 0, ops = 20000, num_blocks = 64, cache_size = 64, write_pct = 10;
+  const char *transport = "unix", *shared_cache = NULL;
+  uint8_t buf[JBOD_BLOCK_SIZE];
+
+  while ((ch = getopt(argc, argv, COHERENCE_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'c':
+        num_clients = atoi(optarg);
+        break;
+      case 'i':
+        num_idle = atoi(optarg);
+        break;
+      case 'n':
+        ops = atoi(optarg);
+        break;
+      case 'b':
+        num_blocks = atoi(optarg);
+        break;
+      case 's':
+        cache_size = atoi(optarg);
+        break;
+      case 'S':
+        shared_cache = optarg;
+        break;
+      case 'w':
+        write_pct = atoi(optarg);
+        break;
+      case 't':
+        transport = optarg;
+        break;
+      case 'X':
+        jbod_set_capability_mask(strtoul(optarg, NULL, 0));
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return 1;
+    }
+  }
+  if (num_clients < 1 || num_idle < 0 || ops < 0 || num_blocks < 1 ||
+      num_blocks > JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK || cache_size < 0)
+    errx(1, "Bad arguments.\n%s", USAGE);
+  if (shared_cache && cache_size == 0)
+    errx(1, "A shared cache needs a cache size.");
+  /* A segment left over from an earlier run holds another device's blocks */
+  if (shared_cache)
+    cache_unlink_shared(shared_cache);
+
+  /* The bookkeeping outlives the fork, so it goes in a shared mapping; the
+   * idle clients come after the others in the results */
+  int num_all = num_clients + num_idle;
+  size_t shared_len = num_blocks * sizeof(coherence_block_t) + num_all * sizeof(coherence_result_t) +
+                      sizeof(_Atomic int);
+  void *shared = mmap(NULL, shared_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+    err(1, "Cannot map the shared bookkeeping");
+  coherence_block_t *blocks = shared;
+  coherence_result_t *results = (coherence_result_t *)(blocks + num_blocks);
+  _Atomic int *busy = (_Atomic int *)(results + num_all);
+  atomic_store(busy, 1);
+  pid_t *pids = malloc(num_all * sizeof(pid_t));
+  if (pids == NULL)
+    err(1, "Cannot allocate the client table");
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  for (int b = 0; b < num_blocks; ++b)
+    pthread_mutex_init(&blocks[b].lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  /* The parent mounts and stamps version 0 on every hot block; the clients
+   * inherit the mount and open connections of their own. The parent drops
+   * its connection meanwhile, since it would not drain the invalidations
+   * of the blocks it wrote. */
+  if (!connect_server(transport))
+    errx(1, "Failed to connect to the server over %s.", transport);
+  if (mdadm_mount() != 1)
+    errx(1, "Failed to mount.");
+  for (int b = 0; b < num_blocks; ++b) {
+    stamp_block(buf, 0, 0);
+    if (mdadm_write((uint64_t)b * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf) == -1)
+      errx(1, "Failed to initialize block %d.", b);
+  }
+  jbod_disconnect();
+
+  for (int c = 0; c < num_all; ++c) {
+    pid_t pid = fork();
+    if (pid == -1)
+      err(1, "fork failed");
+    pids[c] = pid;
+    if (pid == 0) {
+      jbod_disconnect();
+      if (!connect_server(transport))
+        errx(1, "client %d: failed to connect", c);
+      if (shared_cache)
+        rc = cache_create_shared(shared_cache, cache_size);
+      else
+        rc = cache_size ? cache_create(cache_size) : 1;
+      if (rc != 1)
+        errx(1, "client %d: failed to create cache", c);
+      if (c < num_clients) {
+        run_client(c, blocks, num_blocks, ops, write_pct, &results[c]);
+      } else {
+        run_idle_client(c, blocks, num_blocks, busy, &results[c]);
+      }
+      if (cache_size)
+        cache_destroy();
+      jbod_disconnect();
+      _exit(0);
+    }
+  }
+
+  /* The idle clients wake once the others are done, failed or not */
+  int status, failed = 0;
+  for (int c = 0; c < num_all; ++c) {
+    if (c == num_clients)
+      atomic_store(busy, 0);
+    if (waitpid(pids[c], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      ++failed;
+  }
+  free(pids);
+  if (!connect_server(transport))
+    errx(1, "Failed to reconnect to the server over %s.", transport);
+  mdadm_unmount();
+  jbod_disconnect();
+  if (shared_cache)
+    cache_unlink_shared(shared_cache);
+
+  uint64_t reads = 0, writes = 0, stale = 0, torn = 0;
+  float hit_rate = 0, shared_hit_rate = 0;
+  for (int c = 0; c < num_all; ++c) {
+    printf("%sclient %d: %lu reads, %lu writes, %lu stale, %lu torn, hit rate %5.1f%%",
+           c < num_clients ? "" : "idle ", c, (unsigned long)results[c].reads, (unsigned long)results[c].writes,
+           (unsigned long)results[c].stale, (unsigned long)results[c].torn, results[c].hit_rate);
+    if (shared_cache)
+      printf(" (%5.1f%% from other clients)", results[c].shared_hit_rate);
+    printf("\n");
+    reads += results[c].reads;
+    writes += results[c].writes;
+    stale += results[c].stale;
+    torn += results[c].torn;
+    /* The idle clients only read each block twice, so leave them out of the mean */
+    if (c < num_clients) {
+      hit_rate += results[c].hit_rate / num_clients;
+      shared_hit_rate += results[c].shared_hit_rate / num_clients;
+    }
+  }
+  printf("total: %lu reads, %lu writes, %lu stale, %lu torn, mean hit rate %5.1f%%",
+         (unsigned long)reads, (unsigned long)writes, (unsigned long)stale, (unsigned long)torn, hit_rate);
+  if (shared_cache)
+    printf(" (%5.1f%% from other clients)", shared_hit_rate);
+  printf("\n");
+  munmap(shared, shared_len);
+
+  if (failed)
+    errx(1, "%d clients failed.", failed);
+  return stale || torn ? 1 : 0;
+}
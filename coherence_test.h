@@ -0,0 +1,38 @@
+#ifndef COHERENCE_TEST_H_
+#define COHERENCE_TEST_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Multi-client coherence test: forked clients, each with a private cache
+ * (or all attached to one shared cache) and its own connection to the
+ * server, read and write a small set of hot blocks at the same time.
+ * Every write stamps its block with a new version; a read must return at
+ * least the version the last completed write of the block left, or it came
+ * out of a stale cache entry. Idle clients read every hot block, wait out
+ * the others without draining their invalidations, and read every block
+ * again. */
+
+/* The bookkeeping of one hot block, shared by every client */
+typedef struct {
+  pthread_mutex_t lock;        /* held by a writer across its mdadm_write */
+  _Atomic uint32_t version;    /* version of the last completed write */
+} coherence_block_t;
+
+/* What one client saw, reported back to the parent */
+typedef struct {
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t stale;              /* reads older than a completed write */
+  uint64_t torn;               /* reads mixing the stamps of two writes */
+  float hit_rate;
+  float shared_hit_rate;       /* hits on blocks other clients cached */
+} coherence_result_t;
+
+/* The stamp a write repeats across its block */
+typedef struct {
+  uint32_t version;
+  uint32_t writer;
+} coherence_stamp_t;
+
+#endif
@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <err.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "jbod.h"
+#include "net.h"
+#include "ring.h"
+#include "util.h"
+#include "local_server.h"
+
+#define SERVER_ARGUMENTS "hp:u:m:v"
+#define USAGE                                                               \
+  "USAGE: local_server [-h] [-p port] [-u socket_path] [-m shm_name] [-v]\n" \
+  "\n"                                                                      \
+  "where:\n"                                                                \
+  "    -h - help mode (display this message)\n"                             \
+  "    -p - listen for TCP clients on this port (default JBOD_PORT)\n"      \
+  "    -u - also listen for AF_UNIX clients on this socket path\n"          \
+  "    -m - also serve a shared-memory client on this ring pair name\n"     \
+  "    -v - log every command through debug_log\n"                          \
+  "\n"                                                                      \
+
+/* Serializes every jbod_operation, since the JBOD has a single I/O position */
+static pthread_mutex_t jbod_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The client whose I/O position the JBOD currently holds */
+static local_client_t *positioned = NULL;
+
+/* Clients that were handed a token, at index token - 1; under jbod_lock */
+static local_client_t *clients[LOCAL_SERVER_MAX_CLIENTS];
+
+/* Orders the sends on the side channels; taken after jbod_lock when both
+ * are held */
+static pthread_mutex_t push_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The side channels of the clients, at the same index as in clients, or -1;
+ * under push_lock. They live apart from the clients so that a push collected
+ * for a client that has gone away meanwhile finds -1, not a freed client. */
+static int side_sds[LOCAL_SERVER_MAX_CLIENTS];
+
+static bool nread(int fd, int len, uint8_t *buf) {
+  int total = 0;
+  while (total < len) {
+    int n = read(fd, buf + total, len - total);
+    if (n <= 0)
+      return false;
+    total += n;
+  }
+  return true;
+}
+
+static bool nwrite(int fd, int len, const uint8_t *buf) {
+  int total = 0;
+  while (total < len) {
+    int n = write(fd, buf + total, len - total);
+    if (n <= 0)
+      return false;
+    total += n;
+  }
+  return true;
+}
+
+static bool client_read(local_client_t *client, int len, uint8_t *buf) {
+  if (client->rings != NULL) {
+    return ring_read(&client->rings->requests, buf, len, &client->rings->client_pid);
+  }
+  return nread(client->sd, len, buf);
+}
+
+static bool client_write(local_client_t *client, int len, const uint8_t *buf) {
+  if (client->rings != NULL) {
+    return ring_write(&client->rings->responses, buf, len, &client->rings->client_pid);
+  }
+  return nwrite(client->sd, len, buf);
+}
+
+/* Runs |op| for |client| on the JBOD, first restoring the client's I/O
+ * position if another client moved it: its disk before a seek to a block,
+ * and its disk and block before a read or write. Must hold jbod_lock. */
+static int client_operation(local_client_t *client, uint32_t op, uint8_t *block) {
+  uint32_t cmd = (op >> 14) & 0x3f;
+  uint32_t disk = op >> 28;
+  uint32_t blk = (op >> 20) & 0xff;
+
+  if ((cmd == JBOD_SEEK_TO_BLOCK || cmd == JBOD_READ_BLOCK || cmd == JBOD_WRITE_BLOCK) &&
+      positioned != client) {
+    if (jbod_operation((JBOD_SEEK_TO_DISK << 14) | (client->disk << 28), NULL) != 0 ||
+        (cmd != JBOD_SEEK_TO_BLOCK &&
+         jbod_operation((JBOD_SEEK_TO_BLOCK << 14) | (client->block << 20), NULL) != 0)) {
+      positioned = NULL;
+      return -1;
+    }
+  }
+
+  int rc = jbod_operation(op, block);
+  if (rc == 0) {
+    switch (cmd) {
+      case JBOD_SEEK_TO_DISK:
+        client->disk = disk;
+        client->block = 0;
+        break;
+      case JBOD_SEEK_TO_BLOCK:
+        client->block = blk;
+        break;
+      case JBOD_READ_BLOCK:
+      case JBOD_WRITE_BLOCK:
+        client->block++;
+        break;
+    }
+  }
+  /* After a failure nobody knows where the JBOD is positioned */
+  if (cmd >= JBOD_SEEK_TO_DISK && cmd <= JBOD_WRITE_BLOCK)
+    positioned = rc == 0 ? client : NULL;
+  return rc;
+}
+
+/* Runs the extent |op| for |client|: |count| blocks from the disk and block
+ * in the opcode, out of or into |blocks|. Must hold jbod_lock. */
+static int extent_operation(local_client_t *client, uint32_t op, uint32_t count, uint8_t *blocks) {
+  uint32_t cmd = (op >> 14) & 0x3f;
+  uint32_t disk = op >> 28;
+  uint32_t blk = (op >> 20) & 0xff;
+  jbod_cmd_t block_cmd = cmd == JBOD_READ_EXTENT ? JBOD_READ_BLOCK : JBOD_WRITE_BLOCK;
+
+  if (count == 0 || count > JBOD_MAX_EXTENT_BLOCKS || blk + count > JBOD_NUM_BLOCKS_PER_DISK)
+    return -1;
+  if (jbod_operation((JBOD_SEEK_TO_DISK << 14) | (disk << 28), NULL) != 0 ||
+      jbod_operation((JBOD_SEEK_TO_BLOCK << 14) | (blk << 20), NULL) != 0)
+    return -1;
+  client->disk = disk;
+  client->block = blk;
+  positioned = client;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (jbod_operation(block_cmd << 14, blocks + i * JBOD_BLOCK_SIZE) != 0)
+      return -1;
+    client->block++;
+  }
+  return 0;
+}
+
+/* Merges the |len| bytes of |data| at |offset| into the block at the disk
+ * and block in |op| for |client|, leaving the updated block in |block|.
+ * Must hold jbod_lock. */
+static int partial_operation(local_client_t *client, uint32_t op, uint32_t offset, uint32_t len,
+                             const uint8_t *data, uint8_t *block) {
+  uint32_t disk = op >> 28;
+  uint32_t blk = (op >> 20) & 0xff;
+
+  if (offset >= JBOD_BLOCK_SIZE || len == 0 || len > JBOD_BLOCK_SIZE - offset)
+    return -1;
+  /* Reading advances the position, so seek back to the block to write it */
+  if (jbod_operation((JBOD_SEEK_TO_DISK << 14) | (disk << 28), NULL) != 0 ||
+      jbod_operation((JBOD_SEEK_TO_BLOCK << 14) | (blk << 20), NULL) != 0 ||
+      jbod_operation(JBOD_READ_BLOCK << 14, block) != 0)
+    return -1;
+  memmove(block + offset, data, len);
+  if (jbod_operation((JBOD_SEEK_TO_BLOCK << 14) | (blk << 20), NULL) != 0 ||
+      jbod_operation(JBOD_WRITE_BLOCK << 14, block) != 0)
+    return -1;
+  client->disk = disk;
+  client->block = blk + 1;
+  positioned = client;
+  return 0;
+}
+
+/* Hands |client| a token for subscribing a side channel; returns it, or 0
+ * if every token is taken. Must hold jbod_lock. */
+static uint32_t register_client(local_client_t *client) {
+  if (client->id == 0) {
+    for (uint32_t i = 0; i < LOCAL_SERVER_MAX_CLIENTS; ++i) {
+      if (clients[i] == NULL) {
+        clients[i] = client;
+        client->id = i + 1;
+        break;
+      }
+    }
+  }
+  return client->id;
+}
+
+/* Makes the connection of |side| the side channel of the client holding
+ * |token|, acknowledging with the request in |packet|; returns true on
+ * success. Pushes hold push_lock too, so none can overtake the reply. A
+ * client subscribes again after the server closed its side channel, and
+ * then drops its whole cache, so what it was known to cache is forgotten. */
+static bool subscribe(local_client_t *side, uint32_t token, uint8_t *packet) {
+  bool ok = false;
+
+  *(uint16_t *)packet = htons(HEADER_LEN);
+  *(uint16_t *)(packet + 6) = 0;
+  pthread_mutex_lock(&jbod_lock);
+  pthread_mutex_lock(&push_lock);
+  if (side->id == 0 && token >= 1 && token <= LOCAL_SERVER_MAX_CLIENTS &&
+      clients[token - 1] != NULL && side_sds[token - 1] == -1 &&
+      nwrite(side->sd, HEADER_LEN, packet) && fcntl(side->sd, F_SETFL, O_NONBLOCK) != -1) {
+    side_sds[token - 1] = side->sd;
+    clients[token - 1]->subscribed = true;
+    memset(clients[token - 1]->interest, 0, sizeof(clients[token - 1]->interest));
+    ok = true;
+  }
+  pthread_mutex_unlock(&push_lock);
+  pthread_mutex_unlock(&jbod_lock);
+  return ok;
+}
+
+/* Bit index of |block| of |disk| in an interest map */
+static uint32_t interest_bit(uint32_t disk, uint32_t block) {
+  return disk * JBOD_NUM_BLOCKS_PER_DISK + block;
+}
+
+/* Records that |client| moved |count| blocks from |block| of |disk|, and
+ * so may cache them, and if it wrote them, collects in |pushes| an
+ * invalidation for every other subscribed client that may cache them;
+ * returns the number collected, at most one per client. Must hold
+ * jbod_lock; unlock_and_push sends them. */
+static int track(local_client_t *client, bool write, uint32_t disk, uint32_t block, uint32_t count,
+                 local_push_t *pushes) {
+  int num_pushes = 0;
+
+  if (disk >= JBOD_NUM_DISKS || count == 0 || block + count > JBOD_NUM_BLOCKS_PER_DISK)
+    return 0;
+  for (uint32_t i = 0; write && i < LOCAL_SERVER_MAX_CLIENTS; ++i) {
+    local_client_t *other = clients[i];
+    if (other == NULL || other == client || !other->subscribed)
+      continue;
+    /* One message for the stretch between the first and last blocks it has */
+    int first = -1, last = -1;
+    for (uint32_t b = block; b < block + count; ++b) {
+      uint32_t bit = interest_bit(disk, b);
+      if (other->interest[bit / 8] & (1 << (bit % 8))) {
+        other->interest[bit / 8] &= ~(1 << (bit % 8));
+        if (first == -1)
+          first = b;
+        last = b;
+      }
+    }
+    if (first == -1)
+      continue;
+    pushes[num_pushes].index = i;
+    pushes[num_pushes].op = (JBOD_INVALIDATE << 14) | (disk << 28) | (first << 20) | (last - first + 1);
+    ++num_pushes;
+  }
+  if (client->id != 0) {
+    for (uint32_t b = block; b < block + count; ++b) {
+      uint32_t bit = interest_bit(disk, b);
+      client->interest[bit / 8] |= 1 << (bit % 8);
+    }
+  }
+  return num_pushes;
+}
+
+/* Releases jbod_lock and sends the |num_pushes| invalidations in |pushes|,
+ * before the caller replies. The sends happen outside jbod_lock, so other
+ * clients reach the JBOD meanwhile, but push_lock is taken first: a later
+ * write, whose track finds nothing left to push, then still cannot be
+ * acknowledged before these are queued. The side channels never block. A
+ * client whose socket buffer is full has fallen too far behind to be told
+ * which blocks changed, so its side channel is closed; seeing that, it drops
+ * its whole cache and subscribes again. */
+static void unlock_and_push(const local_push_t *pushes, int num_pushes) {
+  uint8_t packet[HEADER_LEN];
+
+  pthread_mutex_lock(&push_lock);
+  pthread_mutex_unlock(&jbod_lock);
+  *(uint16_t *)packet = htons(HEADER_LEN);
+  *(uint16_t *)(packet + 6) = 0;
+  for (int i = 0; i < num_pushes; ++i) {
+    int sd = side_sds[pushes[i].index];
+    if (sd == -1)
+      continue;
+    *(uint32_t *)(packet + 2) = htonl(pushes[i].op);
+    /* Half a packet would tear the stream as surely as a dropped one */
+    if (write(sd, packet, HEADER_LEN) != HEADER_LEN) {
+      close(sd);
+      side_sds[pushes[i].index] = -1;
+    }
+  }
+  pthread_mutex_unlock(&push_lock);
+}
+
+/* Whether a request with opcode |op| may be |len| bytes long, checked before
+ * its payload is read: only writes carry one, of the size they name */
+static bool valid_request_len(uint32_t op, uint32_t len) {
+  if (len < HEADER_LEN || len > JBOD_MAX_PACKET_LEN)
+    return false;
+  uint32_t payload = len - HEADER_LEN;
+  switch ((op >> 14) & 0x3f) {
+    case JBOD_WRITE_BLOCK:
+      return payload == JBOD_BLOCK_SIZE;
+    case JBOD_WRITE_EXTENT:
+      return payload == JBOD_OP_COUNT(op) * JBOD_BLOCK_SIZE;
+    case JBOD_WRITE_PARTIAL:
+      /* The exact length depends on the byte count in the payload */
+      return payload > JBOD_PARTIAL_HEADER_LEN && payload <= JBOD_PARTIAL_HEADER_LEN + JBOD_BLOCK_SIZE;
+    default:
+      return payload == 0;
+  }
+}
+
+void local_server_serve(local_client_t *client) {
+  /* Large enough for the biggest extent */
+  uint8_t *packet = malloc(JBOD_MAX_PACKET_LEN);
+  local_push_t pushes[LOCAL_SERVER_MAX_CLIENTS];
+
+  if (packet == NULL)
+    return;
+  for (;;) {
+    if (!client_read(client, HEADER_LEN, packet))
+      break;
+    uint16_t len = ntohs(*(uint16_t *)packet);
+    uint32_t op = ntohl(*(uint32_t *)(packet + 2));
+    uint32_t cmd = (op >> 14) & 0x3f;
+    /* A client whose length does not fit its request cannot be trusted to
+     * frame the next one either, so drop it */
+    if (!valid_request_len(op, len) ||
+        (len > HEADER_LEN && !client_read(client, len - HEADER_LEN, packet + HEADER_LEN)))
+      break;
+
+    /* Only reads and signatures carry a block back, like the vendor server,
+     * plus the blocks of a read extent and, on request, a partial write */
+    int rc, reply_len = HEADER_LEN, num_pushes = 0;
+    switch (cmd) {
+      case JBOD_HELLO:
+        rc = 0;
+        op = (op & 0xfc000u) | JBOD_CAP_EXTENT | JBOD_CAP_PARTIAL_WRITE;
+        /* Only a socket client can open a side channel */
+        if (client->rings == NULL) {
+          pthread_mutex_lock(&jbod_lock);
+          uint32_t token = register_client(client);
+          pthread_mutex_unlock(&jbod_lock);
+          if (token != 0)
+            op |= JBOD_CAP_INVALIDATE | (token << 20);
+        }
+        break;
+      case JBOD_SUBSCRIBE:
+        /* From now on this connection only carries invalidations, pushed by
+         * the threads of other clients; it is theirs to close */
+        if (subscribe(client, JBOD_OP_TOKEN(op), packet))
+          client->sd = -1;
+        goto done;
+      case JBOD_WRITE_PARTIAL: {
+        uint8_t block[JBOD_BLOCK_SIZE];
+        uint32_t offset = ntohs(*(uint16_t *)(packet + HEADER_LEN));
+        uint32_t count = ntohs(*(uint16_t *)(packet + HEADER_LEN + 2));
+        pthread_mutex_lock(&jbod_lock);
+        /* The payload must carry exactly the bytes it names */
+        if (len != HEADER_LEN + JBOD_PARTIAL_HEADER_LEN + count)
+          rc = -1;
+        else
+          rc = partial_operation(client, op, offset, count,
+                                 packet + HEADER_LEN + JBOD_PARTIAL_HEADER_LEN, block);
+        if (rc == 0)
+          num_pushes = track(client, true, op >> 28, (op >> 20) & 0xff, 1, pushes);
+        unlock_and_push(pushes, num_pushes);
+        if ((op & JBOD_PARTIAL_RETURN_BLOCK) && rc == 0) {
+          memcpy(packet + HEADER_LEN, block, JBOD_BLOCK_SIZE);
+          reply_len += JBOD_BLOCK_SIZE;
+        }
+        break;
+      }
+      case JBOD_READ_EXTENT:
+      case JBOD_WRITE_EXTENT:
+        pthread_mutex_lock(&jbod_lock);
+        rc = extent_operation(client, op, JBOD_OP_COUNT(op), packet + HEADER_LEN);
+        if (rc == 0)
+          num_pushes = track(client, cmd == JBOD_WRITE_EXTENT, op >> 28, (op >> 20) & 0xff,
+                             JBOD_OP_COUNT(op), pushes);
+        unlock_and_push(pushes, num_pushes);
+        if (cmd == JBOD_READ_EXTENT && rc == 0)
+          reply_len += JBOD_OP_COUNT(op) * JBOD_BLOCK_SIZE;
+        break;
+      default: {
+        pthread_mutex_lock(&jbod_lock);
+        /* Reads and writes go to wherever the client's position is */
+        uint32_t disk = client->disk, block = client->block;
+        rc = client_operation(client, op, packet + HEADER_LEN);
+        if (rc == 0 && (cmd == JBOD_READ_BLOCK || cmd == JBOD_WRITE_BLOCK))
+          num_pushes = track(client, cmd == JBOD_WRITE_BLOCK, disk, block, 1, pushes);
+        unlock_and_push(pushes, num_pushes);
+        if (cmd == JBOD_READ_BLOCK || cmd == JBOD_SIGN_BLOCK)
+          reply_len += JBOD_BLOCK_SIZE;
+        break;
+      }
+    }
+    debug_log("received cmd id = %u [disk id = %u block id = %u count = %u], result = %d",
+              cmd, op >> 28, (op >> 20) & 0xff, JBOD_OP_COUNT(op), rc);
+
+    *(uint16_t *)packet = htons(reply_len);
+    *(uint32_t *)(packet + 2) = htonl(op);
+    *(uint16_t *)(packet + 6) = htons((uint16_t)rc);
+    if (!client_write(client, reply_len, packet))
+      break;
+  }
+
+done:
+  pthread_mutex_lock(&jbod_lock);
+  if (positioned == client)
+    positioned = NULL;
+  if (client->id != 0) {
+    clients[client->id - 1] = NULL;
+    pthread_mutex_lock(&push_lock);
+    if (side_sds[client->id - 1] != -1)
+      close(side_sds[client->id - 1]);
+    side_sds[client->id - 1] = -1;
+    pthread_mutex_unlock(&push_lock);
+  }
+  pthread_mutex_unlock(&jbod_lock);
+  free(packet);
+}
+
+static void *client_thread(void *arg) {
+  local_client_t *client = arg;
+
+  local_server_serve(client);
+  close(client->sd);
+  free(client);
+  return NULL;
+}
+
+static void *accept_thread(void *arg) {
+  int listen_sd = (int)(intptr_t)arg;
+
+  for (;;) {
+    int sd = accept(listen_sd, NULL, NULL);
+    if (sd == -1) {
+      warn("accept failed");
+      continue;
+    }
+    local_client_t *client = calloc(1, sizeof(local_client_t));
+    if (client == NULL) {
+      close(sd);
+      continue;
+    }
+    client->sd = sd;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, client_thread, client) != 0) {
+      close(sd);
+      free(client);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+  return NULL;
+}
+
+static void *ring_thread(void *arg) {
+  local_client_t client = { .sd = -1, .rings = arg };
+
+  /* The rings carry one client at a time and outlive it, so keep serving.
+   * Serving only stops when the client died, maybe halfway through a
+   * packet; drop what it left behind so the next client can attach. */
+  for (;;) {
+    local_server_serve(&client);
+    ring_pair_reset(client.rings);
+  }
+  return NULL;
+}
+
+static int listen_tcp(uint16_t port) {
+  struct sockaddr_in addr;
+  int one = 1;
+
+  int sd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sd == -1)
+    err(1, "Failed to create a socket");
+  if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1)
+    err(1, "setsockopt failed");
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    err(1, "bind failed");
+  if (listen(sd, 16) == -1)
+    err(1, "listen failed");
+  return sd;
+}
+
+static int listen_unix(const char *path) {
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    errx(1, "Socket path %s is too long", path);
+  int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sd == -1)
+    err(1, "Failed to create a socket");
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    err(1, "bind failed");
+  if (listen(sd, 16) == -1)
+    err(1, "listen failed");
+  return sd;
+}
+
+/* What the server leaves in the file system, removed when it is stopped */
+static const char *cleanup_unix_path = NULL, *cleanup_shm_name = NULL;
+static ring_pair_t *cleanup_rings = NULL;
+
+static void shutdown_server(int sig) {
+  if (cleanup_unix_path)
+    unlink(cleanup_unix_path);
+  if (cleanup_rings)
+    ring_pair_destroy(cleanup_shm_name, cleanup_rings);
+  _exit(0);
+}
+
+static void spawn(void *(*fn)(void *), void *arg) {
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, fn, arg) != 0)
+    errx(1, "Failed to create a thread");
+  pthread_detach(tid);
+}
+
+int main(int argc, char *argv[])
+{
+  uint16_t port = JBOD_PORT;
+  char *unix_path = NULL, *shm_name = NULL;
+  int ch;
+
+  while ((ch = getopt(argc, argv, SERVER_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'u':
+        unix_path = optarg;
+        break;
+      case 'm':
+        shm_name = optarg;
+        break;
+      case 'v':
+        enable_debug_log();
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  /* A client that goes away mid-reply must not take the server down */
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int i = 0; i < LOCAL_SERVER_MAX_CLIENTS; ++i)
+    side_sds[i] = -1;
+
+  /* Stopping the server removes its socket file and ring segment, so a
+   * client cannot mistake them for a live server */
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = shutdown_server;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if (unix_path) {
+    spawn(accept_thread, (void *)(intptr_t)listen_unix(unix_path));
+    cleanup_unix_path = unix_path;
+  }
+  if (shm_name) {
+    ring_pair_t *rings = ring_pair_create(shm_name);
+    if (rings == NULL)
+      err(1, "Failed to create ring pair %s", shm_name);
+    cleanup_shm_name = shm_name;
+    cleanup_rings = rings;
+    spawn(ring_thread, rings);
+  }
+
+  fprintf(stderr, "JBOD server listening on port %d...\n", port);
+  accept_thread((void *)(intptr_t)listen_tcp(port));
+  return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef LOCAL_SERVER_H_
+#define LOCAL_SERVER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "jbod.h"
+#include "ring.h"
+
+/* Clients that can subscribe to invalidations at once */
+#define LOCAL_SERVER_MAX_CLIENTS 256
+
+/* An invalidation for the side channel of the client at |index| of the
+ * client table, collected under the JBOD lock and sent once it is released */
+typedef struct {
+  uint32_t index;
+  uint32_t op;
+} local_push_t;
+
+/* A client of the local JBOD server. The JBOD has a single I/O position, so
+ * the server remembers where each client last seeked to and restores that
+ * position before serving its reads and writes; that way clients sharing
+ * the server cannot move each other's position between two requests.
+ *
+ * Socket clients may also subscribe a side channel (JBOD_CAP_INVALIDATE in
+ * net.h). Before acknowledging a write, the server pushes an invalidation
+ * down the side channel of every other client that may cache the blocks. */
+typedef struct {
+  int sd;               /* socket of a TCP or AF_UNIX client, -1 for the rings */
+  ring_pair_t *rings;   /* ring pair of a shared-memory client, NULL otherwise */
+  uint32_t disk;        /* current disk of this client */
+  uint32_t block;       /* current block of this client */
+  uint32_t id;          /* token handed out in the JBOD_HELLO reply, 0 if none */
+  bool subscribed;      /* whether it ever subscribed a side channel */
+  /* Blocks this client read or wrote since it was last told of another
+   * client's write to them, one bit per block of the JBOD */
+  uint8_t interest[JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK / 8];
+} local_client_t;
+
+/* Serves requests from |client| until it disconnects. */
+void local_server_serve(local_client_t *client);
+
+#endif
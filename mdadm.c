@@ -7,46 +7,134 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
 
 #include "cache.h"
+#include "capture.h"
 #include "mdadm.h"
 #include "util.h"
 #include "jbod.h"
 #include "net.h"
+#include "trace.h"
 
 // Keep track of mount status of JBOD system
 // 0-unmounted, 1-mounted
 static int is_mounted = 0;
 
-int mdadm_mount(void) {
-    int result;
+// Blocks mdadm_write was asked to write, and those it skipped because the cache showed them unchanged
+static uint64_t num_block_writes = 0;
+static uint64_t num_elided_writes = 0;
+
+#define MAX_IO_BLOCKS MDADM_MAX_IO_BLOCKS
+
+// Scratch blocks for partial-block reads and read-modify-writes, one per block of an I/O
+// Reusing them keeps mdadm_read and mdadm_write free of heap allocations
+static uint8_t scratch_pool[MAX_IO_BLOCKS][JBOD_BLOCK_SIZE];
+
+// Geometry of the linear device and the values derived from it on every address translation
+// The shifts are -1 unless the corresponding count is a power of two, in which case the divisions become shifts
+static struct {
+    mdadm_geometry_t shape;
+    uint64_t device_size;
+    int block_shift;
+    uint32_t block_mask;
+    int disk_shift;
+    uint32_t disk_mask;
+} geometry = {
+    .shape = {1, JBOD_NUM_DISKS, JBOD_NUM_BLOCKS_PER_DISK},
+    .device_size = (uint64_t)JBOD_NUM_DISKS * JBOD_DISK_SIZE,
+    .block_shift = 8,
+    .block_mask = JBOD_NUM_BLOCKS_PER_DISK - 1,
+    .disk_shift = 4,
+    .disk_mask = JBOD_NUM_DISKS - 1,
+};
+
+// Return log2(value) if value is a power of two, -1 otherwise
+static int exact_log2(uint32_t value) {
+    if ((value & (value - 1)) != 0) {
+        return -1;
+    }
+    return __builtin_ctz(value);
+}
+
+int mdadm_set_geometry(const mdadm_geometry_t *shape) {
+    // The geometry cannot change under a mounted device, and every count must fit in its op field
+    if (is_mounted == 1 || shape == NULL || shape->num_enclosures == 0 ||
+        shape->disks_per_enclosure == 0 || shape->disks_per_enclosure > JBOD_NUM_DISKS ||
+        shape->blocks_per_disk == 0 || shape->blocks_per_disk > JBOD_NUM_BLOCKS_PER_DISK) {
+        return -1;
+    }
+    // Device-wide disk IDs are uint32_t here and int in the cache, so they must stay below INT_MAX
+    if ((uint64_t)shape->num_enclosures * shape->disks_per_enclosure > INT_MAX) {
+        return -1;
+    }
+    geometry.shape = *shape;
+    geometry.device_size = (uint64_t)shape->num_enclosures * shape->disks_per_enclosure *
+                           shape->blocks_per_disk * JBOD_BLOCK_SIZE;
+    geometry.block_shift = exact_log2(shape->blocks_per_disk);
+    geometry.block_mask = shape->blocks_per_disk - 1;
+    geometry.disk_shift = exact_log2(shape->disks_per_enclosure);
+    geometry.disk_mask = shape->disks_per_enclosure - 1;
+    return 1;
+}
+
+uint64_t mdadm_device_size(void) {
+    return geometry.device_size;
+}
+
+// Split a device-wide disk ID into the enclosure holding it and the disk ID within that enclosure
+static void enclosure_disk_id(uint32_t disk_id, uint32_t *enclosure_id, uint32_t *local_disk_id) {
+    if (geometry.disk_shift >= 0) {
+        *enclosure_id = disk_id >> geometry.disk_shift;
+        *local_disk_id = disk_id & geometry.disk_mask;
+    } else {
+        *enclosure_id = disk_id / geometry.shape.disks_per_enclosure;
+        *local_disk_id = disk_id % geometry.shape.disks_per_enclosure;
+    }
+}
+
+// Mount or unmount every enclosure, stopping at the first failure
+// Return the number of enclosures the command succeeded on
+static uint32_t all_enclosures_operation(jbod_cmd_t cmd) {
+    uint32_t enclosure_id;
+    for (enclosure_id = 0; enclosure_id < geometry.shape.num_enclosures; enclosure_id++) {
+        // Shift left to point to Command in 14-19 bits to perform operation. Block can be NULL provided by instruction
+        if (jbod_enclosure_operation(enclosure_id, cmd << 14, NULL) != 0) {
+            break;
+        }
+    }
+    return enclosure_id;
+}
+
+static int mount_all(void) {
     // Check if the system is already mounted, if yes, which means there have been commands, then failed
     if (is_mounted == 1) {
         return -1;
     }
-    // Mount the JBOD system
-    result = jbod_client_operation(JBOD_MOUNT << 14, NULL);  // Shift left to point to Command in 14-19 bits to perform operation. Block can be NULL provided by instruction
-    // Check if the JBOD mount operation was successful
-    // 0-success, -1-failed, as per JBOD system
-    if (result == 0) {
+    // Mount the JBOD system of every enclosure
+    uint32_t mounted = all_enclosures_operation(JBOD_MOUNT);
+    // Check if the JBOD mount operation was successful on all of them
+    if (mounted == geometry.shape.num_enclosures) {
         is_mounted = 1;  // Indicate mounted
+        // Mounting reinitializes the disks, so copies cached before (e.g. in a shared cache) are stale
+        cache_invalidate_all();
         return 1;
-    } else {
-        return -1;
     }
+    // Roll back the enclosures that did mount so that a later attempt can start over
+    for (uint32_t enclosure_id = 0; enclosure_id < mounted; enclosure_id++) {
+        jbod_enclosure_operation(enclosure_id, JBOD_UNMOUNT << 14, NULL);
+    }
+    return -1;
 }
 
-int mdadm_unmount(void) {
-    int result;
+static int unmount_all(void) {
     // Check if the system is already unmounted, if yes, then failed
     if (is_mounted != 1) {
         return -1;
     }
-    // Unmount the JBOD system
-    result = jbod_client_operation(JBOD_UNMOUNT << 14, NULL);  // Shift left to point to Command. Block can be NULL
-    // Check if the JBOD unmount operation was successful
-    // 0-success, -1-failed, as per JBOD system
-    if (result == 0) {
+    // Unmount the JBOD system of every enclosure
+    if (all_enclosures_operation(JBOD_UNMOUNT) == geometry.shape.num_enclosures) {
         is_mounted = 0;  // Indicate unmounted
         return 1;
     } else {
@@ -54,181 +142,385 @@ int mdadm_unmount(void) {
     }
 }
 
-// Helper function to calculate disk and block IDs
-static void disk_block_id(uint32_t addr, uint32_t *disk_id, uint32_t *block_id) {
-    *disk_id = addr / JBOD_DISK_SIZE;
-    *block_id = (addr % JBOD_DISK_SIZE) / JBOD_BLOCK_SIZE;
-}
-
-int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf) {
-    uint32_t address_bound = addr + len;
-    // Read should fail on an umounted system, on a NULL pointer but not for 0-length, on larger than 1024-byte I/O sizes, on an out-of-bound linear address
-    if (is_mounted != 1 || (len != 0 && buf == NULL) || len > 1024 || address_bound > JBOD_NUM_DISKS * JBOD_DISK_SIZE) {
-        return -1;
+// Helper function to calculate the device-wide disk ID and the block ID within that disk
+static void disk_block_id(uint64_t addr, uint32_t *disk_id, uint32_t *block_id) {
+    uint64_t device_block = addr / JBOD_BLOCK_SIZE;
+    if (geometry.block_shift >= 0) {
+        *disk_id = device_block >> geometry.block_shift;
+        *block_id = device_block & geometry.block_mask;
+    } else {
+        *disk_id = device_block / geometry.shape.blocks_per_disk;
+        *block_id = device_block % geometry.shape.blocks_per_disk;
     }
+}
 
-    // Tracking the current disk and block ID, the current address, and the number of bytes read
-    uint32_t disk_id, block_id;
-    uint32_t current_addr = addr;
-    uint32_t bytes_read = 0;
+void mdadm_disk_block_id(uint64_t addr, uint32_t *disk_id, uint32_t *block_id) {
+    disk_block_id(addr, disk_id, block_id);
+}
 
-    // Dynamically allocate the temp_buf for block read
-    uint8_t *temp_buf = (uint8_t *)malloc(JBOD_BLOCK_SIZE);
-    if (temp_buf == NULL) {
-        // If malloc fails, return error
-        return -1;
+// Read or write |count| consecutive blocks of one disk, starting at the device-wide disk ID and block ID, from or into |buf|
+// A server with extents moves them all in one exchange; otherwise seek once and let each block advance the position
+// Return 0 on success, and non-zero on failure
+static int blocks_operation(jbod_cmd_t cmd, uint32_t disk_id, uint32_t block_id, uint32_t count, uint8_t *buf) {
+    uint32_t enclosure_id, local_disk_id;
+    enclosure_disk_id(disk_id, &enclosure_id, &local_disk_id);
+    if (jbod_enclosure_capabilities(enclosure_id) & JBOD_CAP_EXTENT) {
+        uint32_t extent = (cmd == JBOD_READ_BLOCK) ? JBOD_READ_EXTENT : JBOD_WRITE_EXTENT;
+        return jbod_enclosure_operation(enclosure_id, (extent << 14) | (local_disk_id << 28) | (block_id << 20) | count, buf);
     }
+    // Seek to current disk
+    jbod_enclosure_operation(enclosure_id, (JBOD_SEEK_TO_DISK << 14) | (local_disk_id << 28), NULL);
+    // Seek to current block of the disk
+    jbod_enclosure_operation(enclosure_id, (JBOD_SEEK_TO_BLOCK << 14) | (block_id << 20), NULL);
+    for (uint32_t i = 0; i < count; i++) {
+        int rc = jbod_enclosure_operation(enclosure_id, cmd << 14, buf + i * JBOD_BLOCK_SIZE);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
 
-    // Read until the current address reaches the address bound
-    while (current_addr < address_bound) {
-        disk_block_id(current_addr, &disk_id, &block_id);
+// Split the I/O at |addr| of |len| bytes into the blocks it covers, and return their number
+static int split_io(uint64_t addr, uint32_t len, mdadm_io_block_t *blocks) {
+    uint64_t address_bound = addr + len;
+    uint64_t current_addr = addr;
+    int num_blocks = 0;
 
+    while (current_addr < address_bound) {
+        mdadm_io_block_t *block = &blocks[num_blocks++];
+        disk_block_id(current_addr, &block->disk_id, &block->block_id);
         // Calculate the data starts at what bytes into the block
         // If offset is 0, current_addr aligns with the start of a block, otherwise falls within a block
-        uint32_t block_offset = current_addr % JBOD_BLOCK_SIZE;
-        // Find how many bytes remain in the current block from offset
-        uint32_t bytes_in_block = JBOD_BLOCK_SIZE - block_offset;
-        // Calculate the number of bytes to read in this iteration
+        block->offset = current_addr % JBOD_BLOCK_SIZE;
         // Remaining bytes should not exceed the bound, or it will cause stack overflow
-        uint32_t read_now;
-        if (bytes_in_block < (address_bound - current_addr)) {
-            read_now = bytes_in_block;
-        } else {
-            read_now = address_bound - current_addr;
-        }
-
-        // Check if the cache is enabled and the block is in the cache
-        if (cache_enabled() && cache_lookup(disk_id, block_id, temp_buf) == 1) {
-            // If the block is in the cache, copy the block data into the buffer
-            memcpy(buf + bytes_read, temp_buf + block_offset, read_now);
-        } else {
-            // If the block is not in the cache, read the block from the disk
-            // Seek to current disk
-            jbod_client_operation((JBOD_SEEK_TO_DISK << 14) | (disk_id << 28), NULL);
-            // Seek to current block of the disk
-            jbod_client_operation((JBOD_SEEK_TO_BLOCK << 14) | (block_id << 20), NULL);
-            // Read the block from the disk
-            int read_block = jbod_client_operation(JBOD_READ_BLOCK << 14, temp_buf);
-            // Check if read block operation failed
-            if (read_block != 0) {
-                // Free temp_buf on failure
-                free(temp_buf);
-                return -1;
-            }
+        block->length = JBOD_BLOCK_SIZE - block->offset;
+        if (block->length > address_bound - current_addr) {
+            block->length = address_bound - current_addr;
+        }
+        block->buf_offset = current_addr - addr;
+        current_addr += block->length;
+    }
+    return num_blocks;
+}
+
+// Return how many blocks from |first| on follow each other on the same disk, and so can move as one extent
+static int run_length(const mdadm_io_block_t *blocks, int first, int num_blocks) {
+    int count = 1;
+    while (first + count < num_blocks &&
+           blocks[first + count].disk_id == blocks[first].disk_id &&
+           blocks[first + count].block_id == blocks[first].block_id + count) {
+        count++;
+    }
+    return count;
+}
 
+int mdadm_split_io(uint64_t addr, uint32_t len, mdadm_io_block_t *blocks) {
+    return split_io(addr, len, blocks);
+}
+
+int mdadm_run_length(const mdadm_io_block_t *blocks, int first, int num_blocks) {
+    return run_length(blocks, first, num_blocks);
+}
+
+// Read a run of |count| blocks of one disk, whose scratch blocks start at |scratch|
+// Cached blocks are copied straight out of the cache, and each stretch of uncached blocks is fetched in one go
+static int read_run(const mdadm_io_block_t *run, int count, uint8_t (*scratch)[JBOD_BLOCK_SIZE], uint8_t *buf) {
+    const uint8_t *cached[MAX_IO_BLOCKS] = { NULL };
+    uint64_t t0 = TRACE_START();
+
+    // Check which blocks are in the cache, holding them there until they are copied
+    if (cache_enabled()) {
+        for (int i = 0; i < count; i++) {
+            cached[i] = cache_pin(run[i].disk_id, run[i].block_id);
+        }
+    }
+
+    int i = 0;
+    while (i < count) {
+        if (cached[i] != NULL) {
+            // If the block is in the cache, copy the block data straight from the cache into the buffer
+            memcpy(buf + run[i].buf_offset, cached[i] + run[i].offset, run[i].length);
+            cache_unpin(cached[i]);
+            i++;
+            continue;
+        }
+        // Gather the uncached blocks that follow, which the disk returns together
+        int misses = 0;
+        bool whole = true;
+        while (i + misses < count && cached[i + misses] == NULL) {
+            whole = whole && run[i + misses].length == JBOD_BLOCK_SIZE;
+            misses++;
+        }
+        // Whole blocks land directly in the caller's buffer, where they are contiguous; otherwise use scratch
+        uint8_t *blocks_buf = whole ? buf + run[i].buf_offset : scratch[i];
+        if (blocks_operation(JBOD_READ_BLOCK, run[i].disk_id, run[i].block_id, misses, blocks_buf) != 0) {
+            // Release the cached blocks not copied yet
+            for (int k = i + misses; k < count; k++) {
+                cache_unpin(cached[k]);
+            }
+            return -1;
+        }
+        for (int k = 0; k < misses; k++) {
+            const mdadm_io_block_t *block = &run[i + k];
+            uint8_t *block_buf = blocks_buf + k * JBOD_BLOCK_SIZE;
             if (cache_enabled()) {
                 // Insert the block into the cache
-                cache_insert(disk_id, block_id, temp_buf);
+                cache_insert(block->disk_id, block->block_id, block_buf);
+            }
+            // Copy the requested part of the scratch block into buffer
+            if (!whole) {
+                memcpy(buf + block->buf_offset, block_buf + block->offset, block->length);
             }
-            // Copy temp_buf into buffer
-            memcpy(buf + bytes_read, temp_buf + block_offset, read_now);
         }
-
-        // Update the total number of bytes read and current address for next iteration
-        bytes_read = bytes_read + read_now;
-        current_addr = current_addr + read_now;
+        i += misses;
     }
+    // One event for the whole run, whose blocks are fetched together
+    TRACE_END(TRACE_MDADM_READ, count, run[0].disk_id, run[0].block_id, t0);
+    return 0;
+}
 
-    // Free temp_buf after use
-    free(temp_buf);
-    // Get the total number of bytes read
-    return bytes_read;
+// Drop the cached copies of whatever blocks other clients wrote since the last I/O, as pushed by the servers
+// A server pushes them before acknowledging the write, so any write that completed before this I/O is seen
+static void drain_invalidations(void) {
+    uint32_t enclosure_id, local_disk_id, block_id, count;
+    while (jbod_next_invalidation(&enclosure_id, &local_disk_id, &block_id, &count)) {
+        // The server lost track of what this client caches, so drop it all
+        if (count == 0) {
+            cache_invalidate_all();
+            continue;
+        }
+        uint32_t disk_id = enclosure_id * geometry.shape.disks_per_enclosure + local_disk_id;
+        for (uint32_t i = 0; i < count; i++) {
+            cache_invalidate(disk_id, block_id + i);
+        }
+    }
 }
 
-int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf) {
-    uint32_t address_bound = addr + len;
-    // Write should fail on an unmounted system, on a NULL pointer but not for 0-length, on larger than 1024-byte I/O sizes, on an out-of-bound linear address
-    if (is_mounted != 1 || (len != 0 && buf == NULL) || len > 1024 || address_bound > JBOD_NUM_DISKS * JBOD_DISK_SIZE) {
+static int read_bytes(uint64_t addr, uint32_t len, uint8_t *buf) {
+    // Read should fail on an umounted system, on a NULL pointer but not for 0-length, on larger than 1024-byte I/O sizes, on an out-of-bound linear address
+    if (is_mounted != 1 || (len != 0 && buf == NULL) || len > 1024 || addr > geometry.device_size || len > geometry.device_size - addr) {
         return -1;
     }
+    drain_invalidations();
+    mdadm_io_block_t blocks[MAX_IO_BLOCKS];
+    int num_blocks = split_io(addr, len, blocks);
 
-    // Tracking the current disk and block ID, the current address, the number of bytes written, and the number of bytes remaining
-    uint32_t disk_id, block_id;
-    uint32_t current_addr = addr;
-    uint32_t bytes_written = 0;
-    uint32_t bytes_remaining = len;
+    // Read each run of consecutive blocks of a disk; the index of a block within the I/O selects its scratch buffer
+    for (int first = 0; first < num_blocks; ) {
+        int count = run_length(blocks, first, num_blocks);
+        // Keep other processes sharing the cache from changing the blocks between the JBOD read and the insert
+        cache_block_lock(blocks[first].disk_id, blocks[first].block_id, count);
+        int rc = read_run(blocks + first, count, scratch_pool + first, buf);
+        cache_block_unlock(blocks[first].disk_id, blocks[first].block_id, count);
+        if (rc != 0) {
+            return -1;
+        }
+        first += count;
+    }
 
-    // Dynamically allocate the temp_buf for block read
-    uint8_t *temp_buf = (uint8_t *)malloc(JBOD_BLOCK_SIZE);
-    if (temp_buf == NULL) {
-        // If malloc fails, return error
-        return -1;
+    // Get the total number of bytes read
+    return len;
+}
+
+// Write a run of |count| blocks of one disk, whose scratch blocks start at |scratch|
+// Partial blocks are merged on top of their cached copy, or else by the server when it supports partial writes,
+// which saves reading them first; the rest of the run goes out in one go
+static int write_run(const mdadm_io_block_t *run, int count, uint8_t (*scratch)[JBOD_BLOCK_SIZE], const uint8_t *buf) {
+    const uint8_t *cached[MAX_IO_BLOCKS] = { NULL };
+    // The new contents of each block, for the JBOD and the cache
+    uint8_t *data[MAX_IO_BLOCKS];
+    // Whether the server merges the block
+    bool server_merge[MAX_IO_BLOCKS];
+    uint64_t t0 = TRACE_START();
+
+    uint32_t enclosure_id, local_disk_id;
+    enclosure_disk_id(run[0].disk_id, &enclosure_id, &local_disk_id);
+    bool partial_write = (jbod_enclosure_capabilities(enclosure_id) & JBOD_CAP_PARTIAL_WRITE) != 0;
+
+    // Even for a whole block, count the lookup and learn whether to update or insert below
+    if (cache_enabled()) {
+        for (int i = 0; i < count; i++) {
+            cached[i] = cache_pin(run[i].disk_id, run[i].block_id);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        server_merge[i] = partial_write && run[i].length != JBOD_BLOCK_SIZE && cached[i] == NULL;
+    }
+    // Only the first and last blocks of an I/O can be partial, so the blocks written together are contiguous
+    int first = server_merge[0] ? 1 : 0;
+    int last = server_merge[count - 1] ? count - 1 : count;
+    // If they are all whole, they are sent straight from the caller's buffer, which the write only reads;
+    // otherwise they are assembled in scratch
+    bool in_place = true;
+    for (int i = first; i < last; i++) {
+        in_place = in_place && run[i].length == JBOD_BLOCK_SIZE;
     }
 
-    // Write until the remaining bytes reaches to 0
-    while (bytes_remaining > 0) {
-        disk_block_id(current_addr, &disk_id, &block_id);
-        // Calculate the data starts at what bytes into the block
-        // If offset is 0, current_addr aligns with the start of a block, otherwise falls within a block
-        uint32_t block_offset = current_addr % JBOD_BLOCK_SIZE;
-        // Find how many bytes remain in the current block from offset
-        uint32_t bytes_in_block = JBOD_BLOCK_SIZE - block_offset;
-        // Calculate the number of bytes to write in this iteration
-        // Remaining bytes should not exceed the bound, or it will cause stack buffer overflow
-        uint32_t write_now;
-        if (bytes_remaining < bytes_in_block) {
-            write_now = bytes_remaining;
-        } else {
-            write_now = bytes_in_block;
-        }
-
-        // Track the cache hit status
-        int cache_hit = -1;
-        // Check if the cache is enabled
-        if (cache_enabled()) {
-            // Cache operation to update the cache hit status
-            cache_hit = cache_lookup(disk_id, block_id, temp_buf);
-        }
-        // Check if the cache hit status is 1, which means the block is in the cache
-        if (cache_hit != 1) {
-            // Seek to the disk and block
-            jbod_client_operation((JBOD_SEEK_TO_DISK << 14) | (disk_id << 28), NULL);
-            jbod_client_operation((JBOD_SEEK_TO_BLOCK << 14) | (block_id << 20), NULL);
-            // If writing part of a block, read the current block, modify it, and write it back.
-            int read_block = jbod_client_operation(JBOD_READ_BLOCK << 14, temp_buf);
+    for (int i = 0; i < count; i++) {
+        const mdadm_io_block_t *block = &run[i];
+        if (block->length == JBOD_BLOCK_SIZE && in_place) {
+            data[i] = (uint8_t *)buf + block->buf_offset;
+            continue;
+        }
+        data[i] = scratch[i];
+        if (block->length == JBOD_BLOCK_SIZE) {
+            memcpy(data[i], buf + block->buf_offset, JBOD_BLOCK_SIZE);
+            continue;
+        }
+        // If writing part of a block, start from the current block, modify it, and write it back.
+        if (cached[i] != NULL) {
+            // The block is in the cache, so merge on top of the cached copy
+            memcpy(data[i], cached[i], JBOD_BLOCK_SIZE);
+        } else if (server_merge[i]) {
+            continue;
+        } else if (blocks_operation(JBOD_READ_BLOCK, block->disk_id, block->block_id, 1, data[i]) != 0) {
             // Check if read block operation failed
-            if (read_block != 0) {
-                // Free temp_buf on failure
-                free(temp_buf);
-                return -1;
+            for (int k = 0; k < count; k++) {
+                cache_unpin(cached[k]);
             }
+            return -1;
         }
+        // Copy the data to be written into the scratch block
+        memcpy(data[i] + block->offset, buf + block->buf_offset, block->length);
+    }
+    // Blocks at either end of the stretch that the cache already holds byte for byte need no write;
+    // those in the middle still ride along, since splitting the stretch would cost another exchange
+    bool unchanged[MAX_IO_BLOCKS];
+    for (int i = 0; i < count; i++) {
+        unchanged[i] = cached[i] != NULL && memcmp(data[i], cached[i], JBOD_BLOCK_SIZE) == 0;
+    }
+    while (first < last && unchanged[first]) {
+        first++;
+        num_elided_writes++;
+    }
+    while (first < last && unchanged[last - 1]) {
+        last--;
+        num_elided_writes++;
+    }
+    num_block_writes += count;
+    // The cached copies are no longer needed, only whether they were there
+    for (int i = 0; i < count; i++) {
+        cache_unpin(cached[i]);
+    }
 
-        // Copy the data to be written into the temp_buf
-        memcpy(temp_buf + block_offset, buf + bytes_written, write_now);
-
-        // Seek again to the correct position and write the block
-        jbod_client_operation((JBOD_SEEK_TO_DISK << 14) | (disk_id << 28), NULL);
-        jbod_client_operation((JBOD_SEEK_TO_BLOCK << 14) | (block_id << 20), NULL);
-        int write_block = jbod_client_operation(JBOD_WRITE_BLOCK << 14, temp_buf);
-        // Check if write block operation failed
-        if (write_block != 0) {
-            // Return -1 if the write operation failed
-            // Free temp_buf on failure
-            free(temp_buf);
+    // Send only the written bytes of the blocks the server merges, getting the result back if the cache wants it
+    for (int i = 0; i < count; i++) {
+        const mdadm_io_block_t *block = &run[i];
+        if (server_merge[i] && jbod_enclosure_write_partial(enclosure_id, local_disk_id, block->block_id, block->offset,
+                                                            block->length, buf + block->buf_offset,
+                                                            cache_enabled() ? data[i] : NULL) != 0) {
             return -1;
         }
+    }
+    // Write the rest, then check if write block operation failed
+    if (first < last && blocks_operation(JBOD_WRITE_BLOCK, run[first].disk_id, run[first].block_id, last - first, data[first]) != 0) {
+        return -1;
+    }
 
+    for (int i = 0; i < count; i++) {
         // Check if the cache is enabled
         if (cache_enabled()) {
             // Check if the block is in the cache
-            if (cache_hit == 1) {
+            if (cached[i] != NULL) {
                 // Update the cache if the block is in the cache
-                cache_update(disk_id, block_id, temp_buf);
+                cache_update(run[i].disk_id, run[i].block_id, data[i]);
             } else {
                 // Insert the block into the cache if it is not in the cache
-                cache_insert(disk_id, block_id, temp_buf);
+                cache_insert(run[i].disk_id, run[i].block_id, data[i]);
             }
         }
+    }
+    // One event for the whole run, whose blocks are written together
+    TRACE_END(TRACE_MDADM_WRITE, count, run[0].disk_id, run[0].block_id, t0);
+    return 0;
+}
+
+static int write_bytes(uint64_t addr, uint32_t len, const uint8_t *buf) {
+    // Write should fail on an unmounted system, on a NULL pointer but not for 0-length, on larger than 1024-byte I/O sizes, on an out-of-bound linear address
+    if (is_mounted != 1 || (len != 0 && buf == NULL) || len > 1024 || addr > geometry.device_size || len > geometry.device_size - addr) {
+        return -1;
+    }
+    drain_invalidations();
+    mdadm_io_block_t blocks[MAX_IO_BLOCKS];
+    int num_blocks = split_io(addr, len, blocks);
 
-        // Update the total number of bytes written, current address, and remaining bytes for the next iteration
-        bytes_written += write_now;
-        bytes_remaining -= write_now;
-        current_addr += write_now;
+    // Write each run of consecutive blocks of a disk; the index of a block within the I/O selects its scratch buffer
+    for (int first = 0; first < num_blocks; ) {
+        int count = run_length(blocks, first, num_blocks);
+        // Keep other processes sharing the cache from writing the blocks until both the JBOD and the cache hold our copy
+        cache_block_lock(blocks[first].disk_id, blocks[first].block_id, count);
+        int rc = write_run(blocks + first, count, scratch_pool + first, buf);
+        cache_block_unlock(blocks[first].disk_id, blocks[first].block_id, count);
+        if (rc != 0) {
+            return -1;
+        }
+        first += count;
     }
 
-    // Free temp_buf after use
-    free(temp_buf);
     // Get the total number of bytes written
-    return bytes_written;
+    return len;
+}
+
+void mdadm_print_write_stats(void) {
+    fprintf(stderr, "Elided writes: %lu of %lu blocks\n", (unsigned long)num_elided_writes, (unsigned long)num_block_writes);
+}
+
+// The public entry points run the operations above, and record the successful ones while a capture is running
+// The capture needs a timestamp before the call, so the check is the only cost when it is off
+
+int mdadm_mount(void) {
+    if (!capture_enabled()) {
+        return mount_all();
+    }
+    uint64_t start = capture_now();
+    int result = mount_all();
+    if (result == 1) {
+        capture_record("MOUNT", false, 0, 0, 0, start);
+    }
+    return result;
+}
+
+int mdadm_unmount(void) {
+    if (!capture_enabled()) {
+        return unmount_all();
+    }
+    uint64_t start = capture_now();
+    int result = unmount_all();
+    if (result == 1) {
+        capture_record("UNMOUNT", false, 0, 0, 0, start);
+    }
+    return result;
+}
+
+int mdadm_read(uint64_t addr, uint32_t len, uint8_t *buf) {
+    if (!capture_enabled()) {
+        return read_bytes(addr, len, buf);
+    }
+    uint64_t start = capture_now();
+    int result = read_bytes(addr, len, buf);
+    if (result != -1) {
+        capture_record("READ", true, addr, len, 0, start);
+    }
+    return result;
+}
+
+int mdadm_write(uint64_t addr, uint32_t len, const uint8_t *buf) {
+    if (!capture_enabled()) {
+        return write_bytes(addr, len, buf);
+    }
+    uint64_t start = capture_now();
+    int result = write_bytes(addr, len, buf);
+    if (result != -1) {
+        // The trace format describes a write by a fill byte, so mark data that is not one repeated byte
+        uint32_t fill = len ? buf[0] : 0;
+        for (uint32_t i = 1; i < len; i++) {
+            if (buf[i] != buf[0]) {
+                fill = CAPTURE_MIXED_FILL;
+                break;
+            }
+        }
+        capture_record("WRITE", true, addr, len, fill, start);
+    }
+    return result;
 }
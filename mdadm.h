@@ -4,6 +4,52 @@
 #include <stdint.h>
 #include "jbod.h"
 
+/* Shape of the linear device: |num_enclosures| JBODs concatenated in order,
+ * each with |disks_per_enclosure| disks of |blocks_per_disk| blocks. The op
+ * encoding limits an enclosure to JBOD_NUM_DISKS disks of
+ * JBOD_NUM_BLOCKS_PER_DISK blocks; the default is a single full enclosure. */
+typedef struct {
+  uint32_t num_enclosures;
+  uint32_t disks_per_enclosure;
+  uint32_t blocks_per_disk;
+} mdadm_geometry_t;
+
+/* Return 1 on success and -1 on failure. Can only be called while unmounted. */
+int mdadm_set_geometry(const mdadm_geometry_t *geometry);
+
+/* Return the size of the linear address space in bytes. */
+uint64_t mdadm_device_size(void);
+
+/* Store the device-wide disk ID holding |addr|, and the block ID within that
+ * disk, in |disk_id| and |block_id| according to the current geometry. */
+void mdadm_disk_block_id(uint64_t addr, uint32_t *disk_id, uint32_t *block_id);
+
+/* An I/O of at most 1024 bytes touches at most this many blocks when it is
+ * not aligned. */
+#define MDADM_MAX_IO_BLOCKS (1024 / JBOD_BLOCK_SIZE + 1)
+
+/* The part of one block an I/O covers. */
+typedef struct {
+  uint32_t disk_id;
+  uint32_t block_id;
+  uint32_t offset;      /* where the data starts within the block */
+  uint32_t length;      /* how many bytes of the block the I/O covers */
+  uint32_t buf_offset;  /* where those bytes are in the caller's buffer */
+} mdadm_io_block_t;
+
+/* Store the blocks the I/O of |len| bytes at |addr| covers in |blocks|, which
+ * holds MDADM_MAX_IO_BLOCKS, and return their number. This is the split
+ * mdadm_read and mdadm_write perform on every I/O. */
+int mdadm_split_io(uint64_t addr, uint32_t len, mdadm_io_block_t *blocks);
+
+/* Return how many of the |num_blocks| blocks from |first| on follow each
+ * other on one disk, which mdadm_read and mdadm_write move together. */
+int mdadm_run_length(const mdadm_io_block_t *blocks, int first, int num_blocks);
+
+/* Print how many of the blocks mdadm_write was asked to write were skipped
+ * because the cache already held exactly the new contents. */
+void mdadm_print_write_stats(void);
+
 /* Return 1 on success and -1 on failure */
 int mdadm_mount(void);
 
@@ -11,9 +57,9 @@ int mdadm_mount(void);
 int mdadm_unmount(void);
 
 /* Return the number of bytes read on success, -1 on failure. */
-int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf);
+int mdadm_read(uint64_t addr, uint32_t len, uint8_t *buf);
 
 /* Return the number of bytes written on success, -1 on failure. */
-int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf);
+int mdadm_write(uint64_t addr, uint32_t len, const uint8_t *buf);
 
 #endif
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "cache.h"
+#include "jbod.h"
+#include "mdadm.h"
+#include "net.h"
+#include "microbench.h"
+
+/* Each repetition runs for at least this long, which keeps clock reads and
+ * scheduler noise well under a percent of the measurement */
+#define BENCH_MIN_REP_NS 5000000ull
+#define BENCH_REPS 11
+
+/* Number of precomputed keys and I/Os the bodies cycle through */
+#define NUM_KEYS 8192
+#define NUM_IOS 4096
+
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t time_fn(bench_fn_t fn, uint64_t iters) {
+  uint64_t start = now_ns();
+  sink += fn(iters);
+  return now_ns() - start;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+void bench_run(const char *name, bench_fn_t fn) {
+  double ns[BENCH_REPS], mean = 0, var = 0;
+  uint64_t iters = 1;
+
+  /* Doubling until a repetition is long enough doubles as the warmup */
+  while (time_fn(fn, iters) < BENCH_MIN_REP_NS)
+    iters *= 2;
+
+  for (int r = 0; r < BENCH_REPS; ++r) {
+    ns[r] = (double)time_fn(fn, iters) / iters;
+    mean += ns[r];
+  }
+  mean /= BENCH_REPS;
+  for (int r = 0; r < BENCH_REPS; ++r)
+    var += (ns[r] - mean) * (ns[r] - mean);
+  qsort(ns, BENCH_REPS, sizeof(double), compare_double);
+
+  printf("%-36s %10.1f %10.1f %10.1f %7.1f%% %10lu\n", name, ns[BENCH_REPS / 2], ns[0],
+         mean, 100 * sqrt(var / (BENCH_REPS - 1)) / mean, (unsigned long)iters);
+}
+
+/* Cache bodies. Keys below the cache size are resident after prefill, so
+ * the share of such keys in the lookup sequence sets the hit ratio. */
+
+static int cache_entries;
+static int keys[NUM_KEYS];
+
+/* Deterministic generator so every run sees the same sequence */
+static uint32_t lcg_state = 1;
+static uint32_t lcg(void) {
+  lcg_state = lcg_state * 1664525u + 1013904223u;
+  return lcg_state >> 8;
+}
+
+static void cache_setup(int entries, int hit_pct) {
+  uint8_t block[JBOD_BLOCK_SIZE] = {0};
+
+  cache_destroy();
+  if (cache_create(entries) != 1)
+    errx(1, "Failed to create cache of %d entries.", entries);
+  cache_entries = entries;
+  for (int k = 0; k < entries; ++k)
+    cache_insert(k / JBOD_NUM_BLOCKS_PER_DISK, k % JBOD_NUM_BLOCKS_PER_DISK, block);
+
+  lcg_state = 1;
+  for (int i = 0; i < NUM_KEYS; ++i)
+    keys[i] = (int)(lcg() % 100) < hit_pct ? (int)(lcg() % entries) : entries + (int)(lcg() % entries);
+}
+
+static uint64_t bench_cache_lookup(uint64_t iters) {
+  uint8_t buf[JBOD_BLOCK_SIZE];
+  uint64_t hits = 0;
+
+  for (uint64_t i = 0; i < iters; ++i) {
+    int k = keys[i % NUM_KEYS];
+    hits += cache_lookup(k / JBOD_NUM_BLOCKS_PER_DISK, k % JBOD_NUM_BLOCKS_PER_DISK, buf) == 1;
+  }
+  return hits;
+}
+
+static uint64_t bench_cache_pin(uint64_t iters) {
+  uint64_t sum = 0;
+
+  for (uint64_t i = 0; i < iters; ++i) {
+    int k = keys[i % NUM_KEYS];
+    const uint8_t *block = cache_pin(k / JBOD_NUM_BLOCKS_PER_DISK, k % JBOD_NUM_BLOCKS_PER_DISK);
+    if (block != NULL) {
+      sum += block[k % JBOD_BLOCK_SIZE];
+      cache_unpin(block);
+    }
+  }
+  return sum;
+}
+
+/* Cycling through twice as many keys as entries makes every insert miss
+ * and evict the least recently used entry */
+static uint64_t bench_cache_insert(uint64_t iters) {
+  static uint64_t next = 0;
+  uint8_t block[JBOD_BLOCK_SIZE] = {0};
+  uint64_t ok = 0;
+
+  for (uint64_t i = 0; i < iters; ++i, ++next) {
+    int k = next % (2 * cache_entries);
+    ok += cache_insert(k / JBOD_NUM_BLOCKS_PER_DISK, k % JBOD_NUM_BLOCKS_PER_DISK, block) == 1;
+  }
+  return ok;
+}
+
+static uint64_t bench_cache_update(uint64_t iters) {
+  uint8_t block[JBOD_BLOCK_SIZE] = {0};
+
+  for (uint64_t i = 0; i < iters; ++i) {
+    int k = i % cache_entries;
+    block[0] = i;
+    cache_update(k / JBOD_NUM_BLOCKS_PER_DISK, k % JBOD_NUM_BLOCKS_PER_DISK, block);
+  }
+  return block[0];
+}
+
+/* Address mapping bodies */
+
+static uint64_t io_addr[NUM_IOS];
+static uint32_t io_len[NUM_IOS];
+
+static void io_setup(void) {
+  uint64_t size = mdadm_device_size();
+
+  lcg_state = 1;
+  for (int i = 0; i < NUM_IOS; ++i) {
+    io_len[i] = 1 + lcg() % 1024;
+    io_addr[i] = ((uint64_t)lcg() << 8 | lcg()) % (size - io_len[i]);
+  }
+}
+
+static uint64_t bench_disk_block_id(uint64_t iters) {
+  uint32_t disk_id, block_id;
+  uint64_t sum = 0;
+
+  for (uint64_t i = 0; i < iters; ++i) {
+    mdadm_disk_block_id(io_addr[i % NUM_IOS], &disk_id, &block_id);
+    sum += disk_id + block_id;
+  }
+  return sum;
+}
+
+/* The split into blocks and runs mdadm_read and mdadm_write perform on
+ * every I/O, through the same functions */
+static uint64_t bench_block_split(uint64_t iters) {
+  mdadm_io_block_t blocks[MDADM_MAX_IO_BLOCKS];
+  uint64_t sum = 0;
+
+  for (uint64_t i = 0; i < iters; ++i) {
+    int num_blocks = mdadm_split_io(io_addr[i % NUM_IOS], io_len[i % NUM_IOS], blocks);
+    for (int first = 0; first < num_blocks; ) {
+      int count = mdadm_run_length(blocks, first, num_blocks);
+      sum += blocks[first].disk_id ^ blocks[first].block_id ^ count;
+      first += count;
+    }
+  }
+  return sum;
+}
+
+/* Packet codec bodies: jbod_client_operation over a socketpair whose other
+ * end answers every request like a server that does no work */
+
+static bool nread(int fd, int len, uint8_t *buf) {
+  int total = 0;
+  while (total < len) {
+    int n = read(fd, buf + total, len - total);
+    if (n <= 0)
+      return false;
+    total += n;
+  }
+  return true;
+}
+
+static void *responder(void *arg) {
+  int sd = (int)(intptr_t)arg;
+  uint8_t packet[HEADER_LEN + JBOD_BLOCK_SIZE];
+
+  memset(packet, 0, sizeof(packet));
+  while (nread(sd, HEADER_LEN, packet)) {
+    uint16_t len = ntohs(*(uint16_t *)packet);
+    uint32_t cmd = ntohl(*(uint32_t *)(packet + 2)) >> 14;
+    if (len > HEADER_LEN && !nread(sd, JBOD_BLOCK_SIZE, packet + HEADER_LEN))
+      break;
+    int reply_len = HEADER_LEN + (cmd == JBOD_READ_BLOCK ? JBOD_BLOCK_SIZE : 0);
+    *(uint16_t *)packet = htons(reply_len);
+    *(uint16_t *)(packet + 6) = 0;
+    if (write(sd, packet, reply_len) != reply_len)
+      break;
+  }
+  close(sd);
+  return NULL;
+}
+
+static uint64_t bench_packet(uint64_t iters, jbod_cmd_t cmd) {
+  uint8_t block[JBOD_BLOCK_SIZE] = {0};
+  uint64_t rc = 0;
+
+  for (uint64_t i = 0; i < iters; ++i)
+    rc += jbod_client_operation(cmd << 14, block);
+  return rc;
+}
+
+static uint64_t bench_packet_seek(uint64_t iters) {
+  return bench_packet(iters, JBOD_SEEK_TO_BLOCK);
+}
+
+static uint64_t bench_packet_read(uint64_t iters) {
+  return bench_packet(iters, JBOD_READ_BLOCK);
+}
+
+static uint64_t bench_packet_write(uint64_t iters) {
+  return bench_packet(iters, JBOD_WRITE_BLOCK);
+}
+
+int main(int argc, char *argv[])
+{
+  static const int sizes[] = { 16, 256, 1024, 4096 };
+  static const int hit_pcts[] = { 0, 50, 90, 100 };
+  char name[64];
+
+  printf("%-36s %10s %10s %10s %8s %10s\n", "benchmark (ns/op)", "median", "min", "mean", "rsd", "iters");
+
+  for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    for (int h = 0; h < sizeof(hit_pcts) / sizeof(hit_pcts[0]); ++h) {
+      cache_setup(sizes[s], hit_pcts[h]);
+      snprintf(name, sizeof(name), "cache_lookup size=%d hit=%d%%", sizes[s], hit_pcts[h]);
+      bench_run(name, bench_cache_lookup);
+      snprintf(name, sizeof(name), "cache_pin size=%d hit=%d%%", sizes[s], hit_pcts[h]);
+      bench_run(name, bench_cache_pin);
+    }
+    cache_setup(sizes[s], 100);
+    snprintf(name, sizeof(name), "cache_insert size=%d (evicting)", sizes[s]);
+    bench_run(name, bench_cache_insert);
+    cache_setup(sizes[s], 100);
+    snprintf(name, sizeof(name), "cache_update size=%d", sizes[s]);
+    bench_run(name, bench_cache_update);
+  }
+  cache_destroy();
+
+  mdadm_geometry_t shift = { 1, JBOD_NUM_DISKS, JBOD_NUM_BLOCKS_PER_DISK };
+  mdadm_geometry_t divide = { 3, 12, 200 };
+  mdadm_set_geometry(&shift);
+  io_setup();
+  bench_run("disk_block_id 1:16:256 (shifts)", bench_disk_block_id);
+  bench_run("block split 1:16:256 (shifts)", bench_block_split);
+  mdadm_set_geometry(&divide);
+  io_setup();
+  bench_run("disk_block_id 3:12:200 (divisions)", bench_disk_block_id);
+  bench_run("block split 3:12:200 (divisions)", bench_block_split);
+  mdadm_set_geometry(&shift);
+
+  int sv[2];
+  pthread_t tid;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    err(1, "socketpair failed");
+  if (pthread_create(&tid, NULL, responder, (void *)(intptr_t)sv[1]) != 0)
+    errx(1, "Failed to start the responder.");
+  /* Adopting the socket sends JBOD_HELLO, so the responder must be up */
+  if (!jbod_connect_fd(0, sv[0]))
+    errx(1, "Failed to adopt the socketpair.");
+  bench_run("packet round trip SEEK (8+8 B)", bench_packet_seek);
+  bench_run("packet round trip READ (8+264 B)", bench_packet_read);
+  bench_run("packet round trip WRITE (264+8 B)", bench_packet_write);
+  jbod_disconnect();
+  pthread_join(tid, NULL);
+
+  return 0;
+}
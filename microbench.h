@@ -0,0 +1,15 @@
+#ifndef MICROBENCH_H_
+#define MICROBENCH_H_
+
+#include <stdint.h>
+
+/* A benchmark body: performs |iters| operations and returns a value derived
+ * from their results, so the compiler cannot discard the work. */
+typedef uint64_t (*bench_fn_t)(uint64_t iters);
+
+/* Warms |fn| up while calibrating an iteration count that runs for at least
+ * BENCH_MIN_REP_NS, times BENCH_REPS repetitions of it, and prints the
+ * median, minimum, mean and relative standard deviation of ns/op. */
+void bench_run(const char *name, bench_fn_t fn);
+
+#endif
@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "mrc.h"
+
+// Sampling decisions compare the top bits of the key hash with a threshold
+#define MRC_HASH_BITS 24
+
+// Marks a free hash slot or an unused timestamp; no key has it, since block numbers are below 2^32 - 1
+#define MRC_NO_KEY UINT64_MAX
+
+// The ghost stack is kept as SHARDS does: a hash table maps each sampled key
+// to the timestamp of its last reference, and a Fenwick tree over timestamps
+// counts the keys whose last reference falls in any range. The depth of a key
+// is the number of keys referenced after it, so a reference costs O(log n)
+// instead of a walk down the stack. Timestamps are renumbered in order when
+// they run out, which keeps the tree twice the tracked keys in size.
+static uint64_t *table_keys = NULL;  // open addressing with linear probing
+static uint32_t *table_times = NULL; // the last timestamp of the key in the same slot
+static uint32_t table_mask = 0;
+static uint64_t *time_keys = NULL;   // the key last referenced at each timestamp, or MRC_NO_KEY
+static uint32_t *fenwick = NULL;     // counts of the timestamps in use, indexed from 1
+static uint32_t num_times = 0;       // timestamps run from 1 to num_times
+static uint32_t now = 0;             // the latest timestamp handed out
+static uint32_t oldest = 1;          // no timestamp below it is in use
+static uint64_t *histogram = NULL;   // references found at each stack depth
+static int stack_depth = 0;
+static int stack_capacity = 0;
+static double sample_rate = 0;
+static uint64_t threshold = 0;
+static uint64_t num_references = 0;
+static uint64_t num_sampled = 0;
+
+// Mixes the key so that neighbouring blocks are sampled independently
+static uint64_t hash_key(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return key;
+}
+
+static void fenwick_add(uint32_t t, int delta) {
+    for (; t <= num_times; t += t & -t) {
+        fenwick[t] += delta;
+    }
+}
+
+// Returns how many timestamps up to and including |t| are in use
+static uint32_t fenwick_prefix(uint32_t t) {
+    uint32_t sum = 0;
+    for (; t > 0; t -= t & -t) {
+        sum += fenwick[t];
+    }
+    return sum;
+}
+
+// Returns the slot holding |key|, or the free slot where it belongs
+static uint32_t table_slot(uint64_t key) {
+    uint32_t i = hash_key(key) & table_mask;
+    while (table_keys[i] != MRC_NO_KEY && table_keys[i] != key) {
+        i = (i + 1) & table_mask;
+    }
+    return i;
+}
+
+// Empties slot |i|, moving up the keys after it that would no longer be found
+static void table_remove(uint32_t i) {
+    for (uint32_t j = (i + 1) & table_mask; table_keys[j] != MRC_NO_KEY; j = (j + 1) & table_mask) {
+        uint32_t home = hash_key(table_keys[j]) & table_mask;
+        // The key stays if its home lies cyclically in (i, j]
+        bool stays = i < j ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            table_keys[i] = table_keys[j];
+            table_times[i] = table_times[j];
+            i = j;
+        }
+    }
+    table_keys[i] = MRC_NO_KEY;
+}
+
+// Renumbers the timestamps in use from 1, in order, freeing the rest
+static void compact(void) {
+    uint32_t t = 0;
+    for (uint32_t old = oldest; old <= now; old++) {
+        uint64_t key = time_keys[old];
+        if (key == MRC_NO_KEY) {
+            continue;
+        }
+        time_keys[old] = MRC_NO_KEY;
+        time_keys[++t] = key;
+        table_times[table_slot(key)] = t;
+    }
+    now = t;
+    oldest = 1;
+    // Every timestamp up to now is in use; build the tree in linear time
+    memset(fenwick, 0, (num_times + 1) * sizeof(uint32_t));
+    for (uint32_t i = 1; i <= num_times; i++) {
+        fenwick[i] += i <= now;
+        uint32_t parent = i + (i & -i);
+        if (parent <= num_times) {
+            fenwick[parent] += fenwick[i];
+        }
+    }
+}
+
+void mrc_stop(void) {
+    free(table_keys);
+    free(table_times);
+    free(time_keys);
+    free(fenwick);
+    free(histogram);
+    table_keys = time_keys = histogram = NULL;
+    table_times = fenwick = NULL;
+}
+
+int mrc_start(double rate) {
+    if (histogram != NULL || rate <= 0 || rate > 1) {
+        return -1;
+    }
+    // Deeper references would only matter to caches larger than MRC_MAX_ENTRIES
+    stack_capacity = (int)(MRC_MAX_ENTRIES * rate) + 1;
+    // Keep the table at most half full
+    uint32_t table_size = 1;
+    while (table_size < 2 * (uint32_t)stack_capacity) {
+        table_size *= 2;
+    }
+    table_mask = table_size - 1;
+    num_times = 2 * stack_capacity;
+    table_keys = malloc(table_size * sizeof(uint64_t));
+    table_times = malloc(table_size * sizeof(uint32_t));
+    time_keys = malloc((num_times + 1) * sizeof(uint64_t));
+    fenwick = calloc(num_times + 1, sizeof(uint32_t));
+    histogram = calloc(stack_capacity, sizeof(uint64_t));
+    if (table_keys == NULL || table_times == NULL || time_keys == NULL || fenwick == NULL || histogram == NULL) {
+        mrc_stop();
+        return -1;
+    }
+    for (uint32_t i = 0; i < table_size; i++) {
+        table_keys[i] = MRC_NO_KEY;
+    }
+    for (uint32_t t = 0; t <= num_times; t++) {
+        time_keys[t] = MRC_NO_KEY;
+    }
+    now = 0;
+    oldest = 1;
+    stack_depth = 0;
+    sample_rate = rate;
+    threshold = (uint64_t)(rate * (1ull << MRC_HASH_BITS));
+    num_references = 0;
+    num_sampled = 0;
+    return 1;
+}
+
+bool mrc_enabled(void) {
+    return histogram != NULL;
+}
+
+void mrc_reference(int disk_num, int block_num) {
+    uint64_t key = (uint64_t)disk_num << 32 | (uint32_t)block_num;
+
+    ++num_references;
+    if (hash_key(key) >> (64 - MRC_HASH_BITS) >= threshold) {
+        return;
+    }
+    ++num_sampled;
+    if (now == num_times) {
+        compact();
+    }
+    uint32_t slot = table_slot(key);
+    if (table_keys[slot] == key) {
+        // Its depth is the number of sampled keys used since its last reference
+        uint32_t last = table_times[slot];
+        ++histogram[stack_depth - fenwick_prefix(last)];
+        fenwick_add(last, -1);
+        time_keys[last] = MRC_NO_KEY;
+    } else {
+        // A first reference, which misses in a cache of any size
+        if (stack_depth == stack_capacity) {
+            // Too deep to track; the least recently used key falls off
+            while (time_keys[oldest] == MRC_NO_KEY) {
+                ++oldest;
+            }
+            table_remove(table_slot(time_keys[oldest]));
+            fenwick_add(oldest, -1);
+            time_keys[oldest] = MRC_NO_KEY;
+            --stack_depth;
+            // Removing a key may have moved the free slot this one belongs in
+            slot = table_slot(key);
+        }
+        table_keys[slot] = key;
+        ++stack_depth;
+    }
+    // Move the key to the top
+    table_times[slot] = ++now;
+    time_keys[now] = key;
+    fenwick_add(now, 1);
+}
+
+void mrc_invalidate(int disk_num, int block_num) {
+    uint64_t key = (uint64_t)disk_num << 32 | (uint32_t)block_num;
+
+    if (hash_key(key) >> (64 - MRC_HASH_BITS) >= threshold) {
+        return;
+    }
+    uint32_t slot = table_slot(key);
+    if (table_keys[slot] != key) {
+        return;
+    }
+    // The cache dropped the block, so its next reference misses at any size
+    uint32_t last = table_times[slot];
+    table_remove(slot);
+    fenwick_add(last, -1);
+    time_keys[last] = MRC_NO_KEY;
+    --stack_depth;
+}
+
+void mrc_invalidate_all(void) {
+    // Forget every key but keep the histogram of the references so far
+    for (uint32_t i = 0; i <= table_mask; i++) {
+        table_keys[i] = MRC_NO_KEY;
+    }
+    for (uint32_t t = 0; t <= num_times; t++) {
+        time_keys[t] = MRC_NO_KEY;
+    }
+    memset(fenwick, 0, (num_times + 1) * sizeof(uint32_t));
+    now = 0;
+    oldest = 1;
+    stack_depth = 0;
+}
+
+double mrc_hit_rate(int num_entries) {
+    if (num_references == 0) {
+        return 0;
+    }
+    // A cache of N entries hits references found at sampled depth below
+    // N * rate; a fractional limit takes that share of the last depth
+    double limit = num_entries * sample_rate;
+    double hits = 0;
+    int depth;
+    for (depth = 0; depth + 1 <= limit && depth < stack_capacity; ++depth) {
+        hits += histogram[depth];
+    }
+    if (depth < stack_capacity) {
+        hits += histogram[depth] * (limit - depth);
+    }
+    // The hash samples more or fewer references than the rate implies; like
+    // SHARDS_adj, credit the difference to the shallowest depth, where most of
+    // the unsampled hot blocks would have landed
+    double expected = num_references * sample_rate;
+    hits += (expected - num_sampled) * (limit < 1 ? limit : 1);
+    double rate = hits / expected;
+    if (rate < 0) {
+        return 0;
+    }
+    return rate > 1 ? 1 : rate;
+}
+
+void mrc_print(void) {
+    fprintf(stderr, "Miss ratio curve: sampled %lu of %lu references at rate %g\n",
+            (unsigned long)num_sampled, (unsigned long)num_references, sample_rate);
+    for (int entries = 2; entries <= MRC_MAX_ENTRIES; entries *= 2) {
+        fprintf(stderr, "MRC %8d entries %5.1f%%\n", entries, 100 * mrc_hit_rate(entries));
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef MRC_H_
+#define MRC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Online miss ratio curve estimation for sizing the cache. The cache feeds
+ * every block it is queried for to mrc_reference. A fixed share of the
+ * blocks, picked by a hash of the block key (spatial sampling, as in
+ * SHARDS), is followed through a ghost LRU stack that holds keys but no
+ * data. The depth at which a sampled block is found again, scaled by the
+ * sampling rate, is the number of distinct blocks referenced in between,
+ * which is exactly the smallest LRU cache that would have hit. One run thus
+ * predicts the hit rate of every cache size at once. As in SHARDS, the
+ * stack is a hash table of last reference times plus a Fenwick tree that
+ * counts the keys referenced since, so a sampled reference costs O(log n)
+ * in the up to MRC_MAX_ENTRIES * rate keys tracked. */
+
+/* Largest cache size the curve covers */
+#define MRC_MAX_ENTRIES 65536
+
+/* Returns 1 on success and -1 on failure. Starts estimating, sampling a
+ * |rate| share of the blocks (0 < rate <= 1). Lower rates cost less time
+ * and memory and lose accuracy at small cache sizes. */
+int mrc_start(double rate);
+
+/* Stops estimating and frees the ghost stack. */
+void mrc_stop(void);
+
+/* Returns true if mrc_start was called without a matching mrc_stop. */
+bool mrc_enabled(void);
+
+/* Records one cache query for the block at |disk_num| and |block_num|. */
+void mrc_reference(int disk_num, int block_num);
+
+/* Drops the block at |disk_num| and |block_num| from the ghost stack when
+ * the cache invalidates it, so its next reference counts as a miss. */
+void mrc_invalidate(int disk_num, int block_num);
+
+/* Empties the ghost stack when the cache drops every block, keeping the
+ * references recorded so far. */
+void mrc_invalidate_all(void);
+
+/* Returns the predicted hit rate, between 0 and 1, of an LRU cache with
+ * |num_entries| entries over the references recorded so far. */
+double mrc_hit_rate(int num_entries);
+
+/* Prints the predicted hit rate at every power of two up to MRC_MAX_ENTRIES. */
+void mrc_print(void);
+
+#endif
@@ -5,14 +5,51 @@
 #include <stdio.h>
 #include <errno.h>
 #include <err.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
+#include <time.h>
 #include "net.h"
 #include "jbod.h"
-
-/* the client socket descriptor for the connection to the server */
-int cli_sd = -1;
+#include "ring.h"
+#include "trace.h"
+
+/* a connection to the server of one enclosure: a socket for TCP and AF_UNIX,
+ * or the mapped ring pair (with sd -1) for shared memory */
+typedef struct {
+    int sd;
+    ring_pair_t *rings;
+    uint32_t caps;      // JBOD_CAP_* bits announced in answer to JBOD_HELLO
+    uint32_t token;     // token for JBOD_SUBSCRIBE from the same answer
+    int side_sd;        // non-blocking socket the server pushes invalidations to, or -1
+    uint8_t side_buf[HEADER_LEN];   // an invalidation partly received on side_sd
+    int side_fill;
+    struct sockaddr_storage side_addr;  // where to subscribe the side channel again
+    socklen_t side_addr_len;
+} jbod_conn_t;
+
+/* the JBOD_CAP_* bits the client is allowed to use */
+static uint32_t capability_mask = ~0u;
+
+/* the client connections to the servers, indexed by enclosure */
+static jbod_conn_t *conns = NULL;
+static uint32_t num_conns = 0;
+
+/* number of request/response exchanges and the total time spent in them */
+static uint64_t num_round_trips = 0;
+static uint64_t round_trip_ns = 0;
+
+/* bytes of whole packets, headers included, sent and received */
+static uint64_t bytes_sent = 0;
+static uint64_t bytes_received = 0;
+
+/* blocks the servers told the client to drop from its cache */
+static uint64_t blocks_invalidated = 0;
+
+/* times a server closed a side channel it fell behind on, costing the whole cache */
+static uint64_t side_resets = 0;
 
 /* attempts to read n (len) bytes from fd; returns true on success and false on failure. 
 It may need to call the system call "read" multiple times to reach the given size len. 
@@ -55,6 +92,24 @@ static bool nwrite(int fd, int len, uint8_t *buf) {
     return true;
 }
 
+/* reads n (len) bytes of a response from conn, over its socket or its response ring */
+static bool conn_read(jbod_conn_t *conn, int len, uint8_t *buf) {
+    if (conn->rings != NULL) {
+        return ring_read(&conn->rings->responses, buf, len, &conn->rings->server_pid);
+    }
+    return nread(conn->sd, len, buf);
+}
+
+
+/* writes n (len) bytes of a request to conn, over its socket or its request ring */
+static bool conn_write(jbod_conn_t *conn, int len, uint8_t *buf) {
+    if (conn->rings != NULL) {
+        return ring_write(&conn->rings->requests, buf, len, &conn->rings->server_pid);
+    }
+    return nwrite(conn->sd, len, buf);
+}
+
+
 /* Through this function call the client attempts to receive a packet from sd 
 (i.e., receiving a response from the server.). It happens after the client previously 
 forwarded a jbod operation call via a request message to the server.  
@@ -67,13 +122,13 @@ block - holds the received block content if existing (e.g., when the op command
 
 In your implementation, you can read the packet header first (i.e., read HEADER_LEN bytes first), 
 and then use the length field in the header to determine whether it is needed to read 
-a block of data from the server. You may use the above nread function here.  
+a block of data from the server. You may use the above conn_read function here.  
 */
-static bool recv_packet(int sd, uint32_t *op, uint16_t *ret, uint8_t *block) {
+static bool recv_packet(jbod_conn_t *conn, uint32_t *op, uint16_t *ret, uint8_t *block, int block_len) {
     uint8_t packet[HEADER_LEN];
 
     // Check if the packet header can be read
-    if (nread(sd, HEADER_LEN, packet) == false) {
+    if (conn_read(conn, HEADER_LEN, packet) == false) {
         return false;
     }
 
@@ -81,59 +136,141 @@ static bool recv_packet(int sd, uint32_t *op, uint16_t *ret, uint8_t *block) {
     int packet_len = ntohs(*(uint16_t *)packet);
     *op = ntohl(*(uint32_t *)(packet + 2));
     *ret = ntohs(*(uint16_t *)(packet + 6));
+    bytes_received += packet_len;
 
-    // Check if the packet length is greater than the header length and the block is not NULL
-    if (packet_len > HEADER_LEN && block != NULL) {
-        // Read the block data from the server
-        if (nread(sd, JBOD_BLOCK_SIZE, block) == true) {
-            return true;
+    // Read the payload into the block, up to the |block_len| bytes it holds
+    int payload_len = packet_len - HEADER_LEN;
+    if (payload_len > 0 && block != NULL) {
+        int n = payload_len < block_len ? payload_len : block_len;
+        if (conn_read(conn, n, block) == false) {
+            return false;
         }
+        payload_len -= n;
+    }
+    // Discard whatever payload the caller has no room for, to stay in step with the stream
+    while (payload_len > 0) {
+        uint8_t discard[JBOD_BLOCK_SIZE];
+        int n = payload_len < JBOD_BLOCK_SIZE ? payload_len : JBOD_BLOCK_SIZE;
+        if (conn_read(conn, n, discard) == false) {
+            return false;
+        }
+        payload_len -= n;
     }
     return true;
 }
 
 
-/* The client attempts to send a jbod request packet to sd (i.e., the server socket here); 
+/* The client attempts to send a jbod request packet to conn (i.e., the server connection here); 
 returns true on success and false on failure. 
 
 op - the opcode. 
 block- when the command is JBOD_WRITE_BLOCK, the block will contain data to write to the server jbod system;
 otherwise it is NULL.
+block_len - the number of bytes of block to send, a whole number of blocks for JBOD_WRITE_EXTENT.
 
 The above information (when applicable) has to be wrapped into a jbod request packet (format specified in readme).
-You may call the above nwrite function to do the actual sending.  
+You may call the above conn_write function to do the actual sending.  
 */
-static bool send_packet(int sd, uint32_t op, uint8_t *block) {
-    uint8_t packet[HEADER_LEN + JBOD_BLOCK_SIZE];
+static bool send_packet(jbod_conn_t *conn, uint32_t op, uint8_t *block, int block_len) {
+    uint8_t packet[JBOD_MAX_PACKET_LEN];
     // Create the packet with the opcode and block data
-    int packet_len = HEADER_LEN + ((block != NULL) ? JBOD_BLOCK_SIZE : 0);
+    int packet_len = HEADER_LEN + ((block != NULL) ? block_len : 0);
     *(uint16_t *)packet = htons(packet_len);
     *(uint32_t *)(packet + 2) = htonl(op);
+    *(uint16_t *)(packet + 6) = 0;
 
     // Check if the block is not NULL
     if (block != NULL) {
         // Copy the block data into the packet
-        memcpy(packet + HEADER_LEN, block, JBOD_BLOCK_SIZE);
+        memcpy(packet + HEADER_LEN, block, block_len);
     }
 
     // Write the packet to the server
-    if (nwrite(sd, packet_len, packet) == false){
+    if (conn_write(conn, packet_len, packet) == false){
         return false;
 
     }
+    bytes_sent += packet_len;
     return true;
 }
 
 
-/* attempts to connect to server and set the global cli_sd variable to the
- * socket; returns true if successful and false if not. 
- * this function will be invoked by tester to connect to the server at given ip and port.
- * you will not call it in mdadm.c
+/* negotiates the extensions of a freshly connected server; defined below */
+static bool hello(jbod_conn_t *conn);
+
+
+/* opens the side channel of |conn| to the server at |addr| if it offers invalidations.
+ * A server that turns it down only costs the client its cache coherence across
+ * clients, so this never fails the connection and always returns true.
 */
-bool jbod_connect(const char *ip, uint16_t port) {
+static bool subscribe(jbod_conn_t *conn, const struct sockaddr *addr, socklen_t addr_len) {
+    uint8_t packet[HEADER_LEN];
+
+    if ((conn->caps & capability_mask & JBOD_CAP_INVALIDATE) == 0) {
+        return true;
+    }
+    int sock = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return true;
+    }
+    *(uint16_t *)packet = htons(HEADER_LEN);
+    *(uint32_t *)(packet + 2) = htonl((JBOD_SUBSCRIBE << 14) | (conn->token << 20));
+    *(uint16_t *)(packet + 6) = 0;
+    // The side channel is up once the server acknowledges the token
+    if (connect(sock, addr, addr_len) == -1 || nwrite(sock, HEADER_LEN, packet) == false ||
+        nread(sock, HEADER_LEN, packet) == false || *(uint16_t *)(packet + 6) != 0 ||
+        fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
+        close(sock);
+        return true;
+    }
+    conn->side_sd = sock;
+    memcpy(&conn->side_addr, addr, addr_len);
+    conn->side_addr_len = addr_len;
+    return true;
+}
+
+
+/* returns the unused connection slot of |enclosure|, growing the table as needed;
+ * returns NULL if the enclosure is already connected or on allocation failure.
+*/
+static jbod_conn_t *new_conn(uint32_t enclosure) {
+    // Grow the connection table to hold this enclosure
+    if (enclosure >= num_conns) {
+        jbod_conn_t *grown = realloc(conns, (enclosure + 1) * sizeof(jbod_conn_t));
+        if (grown == NULL) {
+            return NULL;
+        }
+        for (uint32_t i = num_conns; i <= enclosure; i++) {
+            grown[i].sd = -1;
+            grown[i].rings = NULL;
+            grown[i].caps = 0;
+            grown[i].token = 0;
+            grown[i].side_sd = -1;
+            grown[i].side_fill = 0;
+        }
+        conns = grown;
+        num_conns = enclosure + 1;
+    }
+    // Check if the enclosure is already connected
+    if (conns[enclosure].sd != -1 || conns[enclosure].rings != NULL) {
+        return NULL;
+    }
+    return &conns[enclosure];
+}
+
+
+/* attempts to connect to the server of |enclosure| over TCP and record the
+ * socket in conns; returns true if successful and false if not.
+*/
+bool jbod_connect_enclosure(uint32_t enclosure, const char *ip, uint16_t port) {
     struct sockaddr_in server_addr;
     int sock;
 
+    jbod_conn_t *conn = new_conn(enclosure);
+    if (conn == NULL) {
+        return false;
+    }
+
     // Check if the socket can be created
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
         return false;
@@ -156,56 +293,299 @@ bool jbod_connect(const char *ip, uint16_t port) {
         return false;
     }
 
-    cli_sd = sock;
-    return true;
+    conn->sd = sock;
+    return hello(conn) && subscribe(conn, (struct sockaddr *)&server_addr, sizeof(server_addr));
 }
 
 
-/* disconnects from the server and resets cli_sd */
-void jbod_disconnect(void) {
-    if (cli_sd != -1) {
-        close(cli_sd);
-        cli_sd = -1;
+/* attempts to connect to the server of |enclosure| over the AF_UNIX socket
+ * at |path|; returns true if successful and false if not.
+*/
+bool jbod_connect_unix(uint32_t enclosure, const char *path) {
+    struct sockaddr_un server_addr;
+    int sock;
+
+    jbod_conn_t *conn = new_conn(enclosure);
+    if (conn == NULL || strlen(path) >= sizeof(server_addr.sun_path)) {
+        return false;
     }
+
+    // Check if the socket can be created
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return false;
+    }
+
+    // Set the server address
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    strcpy(server_addr.sun_path, path);
+
+    // Check if the socket can be connected
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        close(sock);
+        return false;
+    }
+
+    conn->sd = sock;
+    return hello(conn) && subscribe(conn, (struct sockaddr *)&server_addr, sizeof(server_addr));
 }
 
 
-/* sends the JBOD operation to the server (use the send_packet function) and receives 
-(use the recv_packet function) and processes the response. 
+/* adopts the already connected stream socket |sd| (e.g. one end of a
+ * socketpair) as the connection of |enclosure|; returns true if successful
+ * and false if not. The socket is closed by jbod_disconnect.
+*/
+bool jbod_connect_fd(uint32_t enclosure, int sd) {
+    jbod_conn_t *conn = new_conn(enclosure);
+    if (conn == NULL) {
+        return false;
+    }
+    conn->sd = sd;
+    return hello(conn);
+}
 
-The meaning of each parameter is the same as in the original jbod_operation function. 
-return: 0 means success, -1 means failure.
+
+/* attempts to attach to the shared-memory ring pair |name| created by the
+ * server of |enclosure|; returns true if successful and false if not.
 */
-int jbod_client_operation(uint32_t op, uint8_t *block) {
-    uint32_t opcode = op >> 14;
-    bool write = opcode == JBOD_WRITE_BLOCK;
+bool jbod_connect_shm(uint32_t enclosure, const char *name) {
+    jbod_conn_t *conn = new_conn(enclosure);
+    if (conn == NULL) {
+        return false;
+    }
+    conn->rings = ring_pair_attach(name);
+    return conn->rings != NULL && hello(conn);
+}
 
-    // Send a packet to the server
-    uint8_t *send_data = NULL;
-    if (write == true) {
-        send_data = block;
-    } else {
-        send_data = NULL;
+
+/* attempts to connect to server and set the connection of enclosure 0; returns
+ * true if successful and false if not.
+ * this function will be invoked by tester to connect to the server at given ip and port.
+ * you will not call it in mdadm.c
+*/
+bool jbod_connect(const char *ip, uint16_t port) {
+    return jbod_connect_enclosure(0, ip, port);
+}
+
+
+/* disconnects from every server and resets conns */
+void jbod_disconnect(void) {
+    for (uint32_t i = 0; i < num_conns; i++) {
+        if (conns[i].sd != -1) {
+            close(conns[i].sd);
+        }
+        if (conns[i].rings != NULL) {
+            ring_pair_detach(conns[i].rings);
+        }
+        if (conns[i].side_sd != -1) {
+            close(conns[i].side_sd);
+        }
     }
+    free(conns);
+    conns = NULL;
+    num_conns = 0;
+}
+
+
+/* prints the number of request/response exchanges, their mean latency and the bytes they moved */
+void jbod_print_net_stats(void) {
+    double mean_us = num_round_trips ? round_trip_ns / 1000.0 / num_round_trips : 0;
+    fprintf(stderr, "Round trips: %lu, mean latency: %.2f us\n", (unsigned long)num_round_trips, mean_us);
+    fprintf(stderr, "Wire bytes: %lu sent, %lu received\n", (unsigned long)bytes_sent, (unsigned long)bytes_received);
+    if (blocks_invalidated || side_resets) {
+        fprintf(stderr, "Invalidated by server: %lu blocks, and the whole cache %lu times\n",
+                (unsigned long)blocks_invalidated, (unsigned long)side_resets);
+    }
+}
+
+
+/* ignores the JBOD_CAP_* bits not in |mask| in whatever servers announce */
+void jbod_set_capability_mask(uint32_t mask) {
+    capability_mask = mask;
+}
+
+
+/* sends a request with opcode |op| and the |send_len| bytes of |send_data| (if not NULL) to the server
+behind |conn| (use the send_packet function), then receives (use the recv_packet function) the response,
+whose payload goes to the |recv_len| bytes of |recv_target| (if not NULL) and whose opcode to |reply_op|.
+return: the return code of the response.
+*/
+static int conn_exchange(jbod_conn_t *conn, uint32_t op, uint8_t *send_data, int send_len,
+                         uint8_t *recv_target, int recv_len, uint32_t *reply_op) {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t t0 = TRACE_START();
+
     // Check if the packet can be sent
-    if (send_packet(cli_sd, op, send_data) == false) {
+    if (send_packet(conn, op, send_data, send_len) == false) {
         return -1;
     }
 
     uint16_t return_code;
 
-    // Receive a packet from the server
-    uint8_t *receive_target = NULL;
+    // Check if the packet can be received
+    if (recv_packet(conn, reply_op, &return_code, recv_target, recv_len) == false) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    num_round_trips++;
+    round_trip_ns += (end.tv_sec - start.tv_sec) * 1000000000ull + (end.tv_nsec - start.tv_nsec);
+    TRACE_END(TRACE_NET_OPERATION, op >> 14 & 0x3f, op >> 28, (op >> 20) & 0xff, t0);
+
+    return (int)return_code;
+}
+
+
+/* sends the JBOD operation to the server behind |conn| and processes the response.
+
+The meaning of each parameter is the same as in the original jbod_operation function, except that
+for the extent commands block holds as many blocks as the count in op.
+return: 0 means success, -1 means failure. The opcode of the response is stored in |reply_op|.
+*/
+static int conn_operation(jbod_conn_t *conn, uint32_t op, uint8_t *block, uint32_t *reply_op) {
+    uint32_t opcode = op >> 14 & 0x3f;
+    bool write = opcode == JBOD_WRITE_BLOCK || opcode == JBOD_WRITE_EXTENT;
+    bool extent = opcode == JBOD_READ_EXTENT || opcode == JBOD_WRITE_EXTENT;
+    int block_len = JBOD_BLOCK_SIZE * (extent ? JBOD_OP_COUNT(op) : 1);
+
+    // An extent must fit in a single packet
+    if (extent && JBOD_OP_COUNT(op) > JBOD_MAX_EXTENT_BLOCKS) {
+        return -1;
+    }
+
+    // A write sends the block, anything else may receive one
     if (write == true) {
-        receive_target = NULL;
-    } else {
-        receive_target = block;
+        return conn_exchange(conn, op, block, block_len, NULL, 0, reply_op);
+    }
+    return conn_exchange(conn, op, NULL, 0, block, block_len, reply_op);
+}
+
+
+/* asks a freshly connected server which extensions it supports; a server
+ * without any answers JBOD_HELLO with an error and gets none used. Returns
+ * false if the exchange itself fails, i.e. the connection is unusable. */
+static bool hello(jbod_conn_t *conn) {
+    uint32_t reply_op;
+    int rc = conn_operation(conn, JBOD_HELLO << 14, NULL, &reply_op);
+    // conn_exchange returns -1 only when the packets could not be sent or received
+    if (rc == -1) {
+        // Free the slot, so the enclosure can be connected again
+        if (conn->sd != -1) {
+            close(conn->sd);
+            conn->sd = -1;
+        }
+        if (conn->rings != NULL) {
+            ring_pair_detach(conn->rings);
+            conn->rings = NULL;
+        }
+        return false;
     }
+    conn->caps = rc == 0 ? JBOD_OP_COUNT(reply_op) : 0;
+    conn->token = rc == 0 ? JBOD_OP_TOKEN(reply_op) : 0;
+    return true;
+}
 
-    // Check if the packet can be received
-    if (recv_packet(cli_sd, &opcode, &return_code, receive_target) == false) {
+
+/* takes the next invalidation waiting on the side channel of any connection, without blocking.
+A server closes the side channel of a client that falls too far behind, so the invalidations
+since are lost; the client then subscribes again and is told to drop every block (a count of 0).
+return: true if there was one, false if not.
+*/
+bool jbod_next_invalidation(uint32_t *enclosure, uint32_t *disk, uint32_t *block, uint32_t *count) {
+    for (uint32_t i = 0; i < num_conns; i++) {
+        jbod_conn_t *conn = &conns[i];
+        while (conn->side_sd != -1) {
+            ssize_t n = recv(conn->side_sd, conn->side_buf + conn->side_fill, HEADER_LEN - conn->side_fill, MSG_DONTWAIT);
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (n <= 0) {
+                // Subscribe first, so no write after the cache is dropped goes untold
+                close(conn->side_sd);
+                conn->side_sd = -1;
+                conn->side_fill = 0;
+                subscribe(conn, (struct sockaddr *)&conn->side_addr, conn->side_addr_len);
+                *enclosure = i;
+                *disk = 0;
+                *block = 0;
+                *count = 0;
+                ++side_resets;
+                return true;
+            }
+            conn->side_fill += n;
+            if (conn->side_fill < (int)HEADER_LEN) {
+                continue;
+            }
+            conn->side_fill = 0;
+            bytes_received += HEADER_LEN;
+            uint32_t op = ntohl(*(uint32_t *)(conn->side_buf + 2));
+            if ((op >> 14 & 0x3f) != JBOD_INVALIDATE) {
+                continue;
+            }
+            *enclosure = i;
+            *disk = op >> 28;
+            *block = (op >> 20) & 0xff;
+            *count = JBOD_OP_COUNT(op);
+            blocks_invalidated += *count;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+uint32_t jbod_enclosure_capabilities(uint32_t enclosure) {
+    if (enclosure >= num_conns) {
+        return 0;
+    }
+    return conns[enclosure].caps & capability_mask;
+}
+
+
+/* sends the JBOD operation to the server of |enclosure|; see conn_operation.
+return: 0 means success, -1 means failure.
+*/
+int jbod_enclosure_operation(uint32_t enclosure, uint32_t op, uint8_t *block) {
+    uint32_t reply_op;
+
+    // Check if the enclosure is connected
+    if (enclosure >= num_conns || (conns[enclosure].sd == -1 && conns[enclosure].rings == NULL)) {
         return -1;
     }
+    return conn_operation(&conns[enclosure], op, block, &reply_op);
+}
 
-    return (int)return_code;
+
+/* writes |len| bytes of |data| at |offset| into the block |block_id| of disk |disk_id| of |enclosure|,
+leaving the rest of the block to the server; if |block| is not NULL the server returns the updated block
+into it. The server must have announced JBOD_CAP_PARTIAL_WRITE.
+return: 0 means success, -1 means failure.
+*/
+int jbod_enclosure_write_partial(uint32_t enclosure, uint32_t disk_id, uint32_t block_id,
+                                 uint32_t offset, uint32_t len, const uint8_t *data, uint8_t *block) {
+    uint8_t payload[JBOD_PARTIAL_HEADER_LEN + JBOD_BLOCK_SIZE];
+    uint32_t reply_op;
+
+    // Check if the enclosure is connected and the bytes lie within one block
+    if (enclosure >= num_conns || (conns[enclosure].sd == -1 && conns[enclosure].rings == NULL) ||
+        offset >= JBOD_BLOCK_SIZE || len == 0 || len > JBOD_BLOCK_SIZE - offset) {
+        return -1;
+    }
+    uint32_t op = (JBOD_WRITE_PARTIAL << 14) | (disk_id << 28) | (block_id << 20);
+    if (block != NULL) {
+        op |= JBOD_PARTIAL_RETURN_BLOCK;
+    }
+    *(uint16_t *)payload = htons(offset);
+    *(uint16_t *)(payload + 2) = htons(len);
+    memcpy(payload + JBOD_PARTIAL_HEADER_LEN, data, len);
+    return conn_exchange(&conns[enclosure], op, payload, JBOD_PARTIAL_HEADER_LEN + len,
+                         block, block != NULL ? JBOD_BLOCK_SIZE : 0, &reply_op);
+}
+
+
+/* same as jbod_enclosure_operation on enclosure 0, the only one of a single-JBOD device */
+int jbod_client_operation(uint32_t op, uint8_t *block) {
+    return jbod_enclosure_operation(0, op, block);
 }
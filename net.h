@@ -4,12 +4,98 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "jbod.h"
+
 #define HEADER_LEN (sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint16_t))
 #define JBOD_SERVER "127.0.0.1"
 #define JBOD_PORT 3333
+#define JBOD_UNIX_PATH "/tmp/jbod.sock"
+#define JBOD_SHM_NAME "/jbod_ring"
+
+/* Protocol extensions, whose commands follow those of jbod.h in the command
+ * field; a server that predates them answers them with an error. Clients
+ * send JBOD_HELLO on connecting, and a server that knows it answers 0 with
+ * the JBOD_CAP_* bits it supports in the reserved bits (0-13) of the opcode
+ * it sends back. */
+#define JBOD_HELLO          (JBOD_NUM_CMDS + 0)
+
+/* Read or write |count| consecutive blocks of the disk in the opcode,
+ * starting at its block; count goes in the reserved bits (0-13) and the
+ * blocks in the payload. Afterwards the position is past the last block. */
+#define JBOD_READ_EXTENT    (JBOD_NUM_CMDS + 1)
+#define JBOD_WRITE_EXTENT   (JBOD_NUM_CMDS + 2)
+#define JBOD_CAP_EXTENT     0x1
+
+/* Write part of a block and have the server merge it into the rest. The
+ * payload is a 2-byte offset and a 2-byte length, in network byte order,
+ * then that many bytes. With JBOD_PARTIAL_RETURN_BLOCK set in the reserved
+ * bits, the reply carries the whole updated block. */
+#define JBOD_WRITE_PARTIAL  (JBOD_NUM_CMDS + 3)
+#define JBOD_CAP_PARTIAL_WRITE 0x2
+#define JBOD_PARTIAL_RETURN_BLOCK 0x1
+#define JBOD_PARTIAL_HEADER_LEN 4
+
+/* Server-pushed cache invalidation. A server with JBOD_CAP_INVALIDATE also
+ * hands the client a token in bits 20-31 of its JBOD_HELLO reply. The client
+ * then opens a second connection to the same address and sends
+ * JBOD_SUBSCRIBE with the token in bits 20-31; once the server answers 0,
+ * that connection only carries JBOD_INVALIDATE packets from the server,
+ * header-only, with the disk and block in the opcode and the number of
+ * blocks in the reserved bits. The server pushes one before acknowledging
+ * another client's write to blocks this client read or wrote. */
+#define JBOD_SUBSCRIBE      (JBOD_NUM_CMDS + 4)
+#define JBOD_INVALIDATE     (JBOD_NUM_CMDS + 5)
+#define JBOD_CAP_INVALIDATE 0x4
+#define JBOD_OP_TOKEN(op)   ((op) >> 20)
+
+#define JBOD_OP_COUNT(op)   ((op) & 0x3fff)
+
+/* The most blocks an extent can carry within the 16-bit packet length */
+#define JBOD_MAX_EXTENT_BLOCKS ((UINT16_MAX - HEADER_LEN) / JBOD_BLOCK_SIZE)
+#define JBOD_MAX_PACKET_LEN (HEADER_LEN + JBOD_MAX_EXTENT_BLOCKS * JBOD_BLOCK_SIZE)
 
 int jbod_client_operation(uint32_t op, uint8_t *block);
 bool jbod_connect(const char *ip, uint16_t port);
 void jbod_disconnect(void);
 
+/* Same as the functions above for the JBOD backing |enclosure| of a
+ * multi-enclosure linear device; enclosure 0 is the one they use. */
+int jbod_enclosure_operation(uint32_t enclosure, uint32_t op, uint8_t *block);
+bool jbod_connect_enclosure(uint32_t enclosure, const char *ip, uint16_t port);
+
+/* Returns the JBOD_CAP_* bits the server of |enclosure| announced when it
+ * was connected; 0 for a server without extensions. */
+uint32_t jbod_enclosure_capabilities(uint32_t enclosure);
+
+/* Writes |len| bytes of |data| at |offset| within block |block_id| of disk
+ * |disk_id| of |enclosure| with JBOD_WRITE_PARTIAL, which the server must
+ * support. If |block| is not NULL, the updated block is returned in it.
+ * Returns 0 on success and -1 on failure. */
+int jbod_enclosure_write_partial(uint32_t enclosure, uint32_t disk_id, uint32_t block_id,
+                                 uint32_t offset, uint32_t len, const uint8_t *data, uint8_t *block);
+
+/* Makes the client ignore the JBOD_CAP_* bits outside |mask|, e.g. to
+ * compare a run with and without an extension. */
+void jbod_set_capability_mask(uint32_t mask);
+
+/* Co-located transports carrying the same packets as TCP: an AF_UNIX socket
+ * at |path|, or the shared-memory ring pair |name| (see ring.h). */
+bool jbod_connect_unix(uint32_t enclosure, const char *path);
+bool jbod_connect_shm(uint32_t enclosure, const char *name);
+
+/* Uses the already connected stream socket |sd| for |enclosure|. */
+bool jbod_connect_fd(uint32_t enclosure, int sd);
+
+/* Takes the next invalidation pushed by any server without waiting for one:
+ * returns true and sets |enclosure|, |disk|, |block| and |count| if there
+ * was one, false if not. A |count| of 0 means the server closed the side
+ * channel, having fallen behind, so every cached block of |enclosure| must
+ * go; the side channel is subscribed again first. */
+bool jbod_next_invalidation(uint32_t *enclosure, uint32_t *disk, uint32_t *block, uint32_t *count);
+
+/* Prints the number of request/response exchanges, their mean latency, and
+ * the bytes of the packets sent and received, and the blocks invalidated
+ * by the servers. */
+void jbod_print_net_stats(void);
+
 #endif
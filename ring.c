@@ -0,0 +1,216 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ring.h"
+
+/* How many times to poll an empty or full ring before sleeping on the futex.
+ * A co-located peer usually answers within this window, which saves the two
+ * syscalls of a sleep and a wake-up per message. On a single CPU the peer
+ * cannot run while we spin, so there we go straight to sleep. */
+#define RING_SPINS 4000
+
+static int ring_spins(void) {
+    static int spins = -1;
+    if (spins == -1) {
+        spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPINS : 0;
+    }
+    return spins;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t expected) {
+    struct timespec timeout = { 0, RING_LIVENESS_INTERVAL_MS * 1000000L };
+    syscall(SYS_futex, addr, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+/* Whether the process in |*peer| has exited; a pid of 0 is no process yet */
+static bool peer_gone(_Atomic int32_t *peer) {
+    pid_t pid = atomic_load(peer);
+    return pid != 0 && kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+static void futex_wake(_Atomic uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Waits until *counter no longer equals |seen|; returns false if the peer
+ * exits first. The waiting flag is raised before the counter is checked
+ * again, so a peer that moves the counter after that check is guaranteed to
+ * see the flag and wake us up. The sleep times out every
+ * RING_LIVENESS_INTERVAL_MS to look for a peer that died without doing so. */
+static bool wait_for_change(_Atomic uint32_t *counter, _Atomic uint32_t *waiting, uint32_t seen,
+                            _Atomic int32_t *peer) {
+    for (int i = ring_spins(); i > 0; i--) {
+        if (atomic_load_explicit(counter, memory_order_acquire) != seen) {
+            return true;
+        }
+        cpu_relax();
+    }
+    while (atomic_load(counter) == seen) {
+        atomic_store(waiting, 1);
+        if (atomic_load(counter) == seen) {
+            futex_wait(counter, seen);
+        }
+        atomic_store(waiting, 0);
+        if (atomic_load(counter) == seen && peer_gone(peer)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Publishes a counter update and wakes the peer if it went to sleep. */
+static void publish(_Atomic uint32_t *counter, _Atomic uint32_t *waiting, uint32_t value) {
+    atomic_store(counter, value);
+    if (atomic_load(waiting)) {
+        futex_wake(counter);
+    }
+}
+
+bool ring_write(ring_t *ring, const uint8_t *buf, uint32_t len, _Atomic int32_t *peer) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    while (len > 0) {
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        // Wait for the consumer if the ring is full
+        if (head - tail == RING_SIZE) {
+            if (!wait_for_change(&ring->tail, &ring->producer_waiting, tail, peer)) {
+                return false;
+            }
+            continue;
+        }
+        // Copy as much as fits, up to the end of the data array
+        uint32_t offset = head & (RING_SIZE - 1);
+        uint32_t n = RING_SIZE - (head - tail);
+        if (n > RING_SIZE - offset) {
+            n = RING_SIZE - offset;
+        }
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ring->data + offset, buf, n);
+        head += n;
+        buf += n;
+        len -= n;
+        publish(&ring->head, &ring->consumer_waiting, head);
+    }
+    return true;
+}
+
+bool ring_read(ring_t *ring, uint8_t *buf, uint32_t len, _Atomic int32_t *peer) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while (len > 0) {
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        // Wait for the producer if the ring is empty
+        if (head == tail) {
+            if (!wait_for_change(&ring->head, &ring->consumer_waiting, head, peer)) {
+                return false;
+            }
+            continue;
+        }
+        // Copy as much as is available, up to the end of the data array
+        uint32_t offset = tail & (RING_SIZE - 1);
+        uint32_t n = head - tail;
+        if (n > RING_SIZE - offset) {
+            n = RING_SIZE - offset;
+        }
+        if (n > len) {
+            n = len;
+        }
+        memcpy(buf, ring->data + offset, n);
+        tail += n;
+        buf += n;
+        len -= n;
+        publish(&ring->tail, &ring->producer_waiting, tail);
+    }
+    return true;
+}
+
+static ring_pair_t *ring_pair_map(const char *name, int flags) {
+    int fd = shm_open(name, flags, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        return NULL;
+    }
+    if ((flags & O_CREAT) && ftruncate(fd, sizeof(ring_pair_t)) == -1) {
+        close(fd);
+        return NULL;
+    }
+    void *addr = mmap(NULL, sizeof(ring_pair_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    return addr;
+}
+
+ring_pair_t *ring_pair_create(const char *name) {
+    ring_pair_t *pair = ring_pair_map(name, O_CREAT | O_RDWR);
+    if (pair == NULL) {
+        return NULL;
+    }
+    memset(pair, 0, sizeof(ring_pair_t));
+    atomic_store(&pair->server_pid, getpid());
+    return pair;
+}
+
+ring_pair_t *ring_pair_attach(const char *name) {
+    ring_pair_t *pair = ring_pair_map(name, O_RDWR);
+    if (pair == NULL) {
+        return NULL;
+    }
+    // A segment left behind by a server that is gone would never be answered
+    if (peer_gone(&pair->server_pid)) {
+        munmap(pair, sizeof(ring_pair_t));
+        return NULL;
+    }
+    // Only one client can own the rings at a time; the server reclaims them from one that died
+    uint32_t detached = 0;
+    if (!atomic_compare_exchange_strong(&pair->attached, &detached, 1)) {
+        munmap(pair, sizeof(ring_pair_t));
+        return NULL;
+    }
+    atomic_store(&pair->client_pid, getpid());
+    return pair;
+}
+
+void ring_pair_detach(ring_pair_t *pair) {
+    atomic_store(&pair->client_pid, 0);
+    atomic_store(&pair->attached, 0);
+    munmap(pair, sizeof(ring_pair_t));
+}
+
+void ring_pair_reset(ring_pair_t *pair) {
+    ring_t *rings[] = { &pair->requests, &pair->responses };
+    for (int i = 0; i < 2; i++) {
+        atomic_store(&rings[i]->head, 0);
+        atomic_store(&rings[i]->tail, 0);
+        atomic_store(&rings[i]->consumer_waiting, 0);
+        atomic_store(&rings[i]->producer_waiting, 0);
+    }
+    atomic_store(&pair->client_pid, 0);
+    atomic_store(&pair->attached, 0);
+}
+
+void ring_pair_destroy(const char *name, ring_pair_t *pair) {
+    munmap(pair, sizeof(ring_pair_t));
+    shm_unlink(name);
+}
@@ -0,0 +1,64 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* Capacity in bytes of each direction of a ring pair; must be a power of two */
+#define RING_SIZE 65536
+
+/* A single-producer/single-consumer byte ring. head and tail count every
+ * byte ever written and read, so head - tail is the fill level even after
+ * the counters wrap. A side that finds the ring empty (or full) spins for a
+ * while, then raises its waiting flag and sleeps on a futex on the other
+ * side's counter; the other side only pays for a wake-up syscall when the
+ * flag is set. */
+typedef struct {
+    _Alignas(64) _Atomic uint32_t head;
+    _Atomic uint32_t consumer_waiting;
+    _Alignas(64) _Atomic uint32_t tail;
+    _Atomic uint32_t producer_waiting;
+    _Alignas(64) uint8_t data[RING_SIZE];
+} ring_t;
+
+/* How long a side sleeps on the futex before checking that its peer process
+ * is still alive */
+#define RING_LIVENESS_INTERVAL_MS 100
+
+/* The shared-memory segment between a JBOD server and one client: requests
+ * flow from client to server, responses from server to client, both in the
+ * packet format of net.h. Each side records its pid, so the other can tell
+ * when it is gone instead of waiting forever. */
+typedef struct {
+    _Atomic uint32_t attached;
+    _Atomic int32_t server_pid;
+    _Atomic int32_t client_pid;     // 0 while no client is attached
+    ring_t requests;
+    ring_t responses;
+} ring_pair_t;
+
+/* Creates (or resets) the named segment and maps it; returns NULL on failure. */
+ring_pair_t *ring_pair_create(const char *name);
+
+/* Maps an existing named segment and marks it attached; returns NULL on
+ * failure, if its server is gone, or if another client is attached. */
+ring_pair_t *ring_pair_attach(const char *name);
+
+/* Marks the segment detached and unmaps it. */
+void ring_pair_detach(ring_pair_t *pair);
+
+/* Empties both rings and detaches the client, e.g. once the server has
+ * found it gone; only the server calls it, with no client running. */
+void ring_pair_reset(ring_pair_t *pair);
+
+/* Unmaps the segment and removes its name. */
+void ring_pair_destroy(const char *name, ring_pair_t *pair);
+
+/* Blocks until |len| bytes have been copied into or out of |ring|; returns
+ * true on success, false if the process in |*peer| exited first. A |*peer|
+ * of 0 (no client attached) is waited for. */
+bool ring_write(ring_t *ring, const uint8_t *buf, uint32_t len, _Atomic int32_t *peer);
+bool ring_read(ring_t *ring, uint8_t *buf, uint32_t len, _Atomic int32_t *peer);
+
+#endif
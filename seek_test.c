@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "jbod.h"
+#include "net.h"
+#include "seek_test.h"
+
+#define SEEK_ARGUMENTS "ht:"
+#define USAGE                                                                 \
+  "USAGE: seek_test [-h] [-t tcp|unix]\n"                                     \
+  "\n"                                                                        \
+  "where:\n"                                                                  \
+  "    -h - help mode (display this message)\n"                               \
+  "    -t - transport to the server (default unix)\n"                         \
+  "\n"
+
+/* Clients A and B */
+#define A 0
+#define B 1
+
+static const seek_step_t steps[] = {
+  /* A fills blocks 7 and 8 of disk 3, B block 7 of disk 5 */
+  { A, JBOD_MOUNT, 0, 0, 0 },
+  { A, JBOD_SEEK_TO_DISK, 3, 0, 0 },
+  { A, JBOD_SEEK_TO_BLOCK, 0, 7, 0 },
+  { A, JBOD_WRITE_BLOCK, 0, 0, 0xaa },
+  { A, JBOD_WRITE_BLOCK, 0, 0, 0xac },
+  { B, JBOD_SEEK_TO_DISK, 5, 0, 0 },
+  { B, JBOD_SEEK_TO_BLOCK, 0, 7, 0 },
+  { B, JBOD_WRITE_BLOCK, 0, 0, 0xbb },
+  /* A seek to a block stays on the client's own disk, not the one the
+   * other client seeked to last */
+  { A, JBOD_SEEK_TO_DISK, 3, 0, 0 },
+  { B, JBOD_SEEK_TO_DISK, 5, 0, 0 },
+  { A, JBOD_SEEK_TO_BLOCK, 0, 7, 0 },
+  { A, JBOD_READ_BLOCK, 0, 0, 0xaa },
+  /* Reads advance each client's own position */
+  { B, JBOD_SEEK_TO_BLOCK, 0, 7, 0 },
+  { A, JBOD_READ_BLOCK, 0, 0, 0xac },
+  { B, JBOD_READ_BLOCK, 0, 0, 0xbb },
+  /* The same after a block seek by the other client */
+  { A, JBOD_SEEK_TO_BLOCK, 0, 7, 0 },
+  { B, JBOD_SEEK_TO_BLOCK, 0, 7, 0 },
+  { A, JBOD_READ_BLOCK, 0, 0, 0xaa },
+  { B, JBOD_READ_BLOCK, 0, 0, 0xbb },
+  { A, JBOD_UNMOUNT, 0, 0, 0 },
+};
+
+static bool connect_client(int client, const char *transport) {
+  if (strcmp(transport, "tcp") == 0)
+    return jbod_connect_enclosure(client, JBOD_SERVER, JBOD_PORT);
+  if (strcmp(transport, "unix") == 0)
+    return jbod_connect_unix(client, JBOD_UNIX_PATH);
+  errx(1, "Unknown transport %s; shared memory serves one client.", transport);
+}
+
+int main(int argc, char *argv[]) {
+  const char *transport = "unix";
+  uint8_t buf[JBOD_BLOCK_SIZE];
+  int ch, failed = 0;
+
+  while ((ch = getopt(argc, argv, SEEK_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 't':
+        transport = optarg;
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return 1;
+    }
+  }
+
+  for (int c = A; c <= B; ++c) {
+    if (!connect_client(c, transport))
+      errx(1, "Client %c failed to connect over %s.", 'A' + c, transport);
+  }
+
+  for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); ++i) {
+    const seek_step_t *step = &steps[i];
+    uint32_t op = (step->cmd << 14) | (step->disk << 28) | (step->block << 20);
+
+    if (step->cmd == JBOD_WRITE_BLOCK)
+      memset(buf, step->fill, JBOD_BLOCK_SIZE);
+    if (jbod_enclosure_operation(step->client, op, buf) != 0) {
+      printf("step %zu: client %c command %u failed\n", i, 'A' + step->client, step->cmd);
+      ++failed;
+      continue;
+    }
+    if (step->cmd == JBOD_READ_BLOCK) {
+      for (int b = 0; b < JBOD_BLOCK_SIZE; ++b) {
+        if (buf[b] != step->fill) {
+          printf("step %zu: client %c read 0x%02x, expected 0x%02x\n", i, 'A' + step->client, buf[b],
+                 step->fill);
+          ++failed;
+          break;
+        }
+      }
+    }
+  }
+  jbod_disconnect();
+
+  printf("%zu steps, %d failed\n", sizeof(steps) / sizeof(steps[0]), failed);
+  return failed ? 1 : 0;
+}
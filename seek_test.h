@@ -0,0 +1,23 @@
+#ifndef SEEK_TEST_H_
+#define SEEK_TEST_H_
+
+#include <stdint.h>
+
+/* Interleaved-seek test: two connections to one server, opened as two
+ * enclosures of this process, take turns seeking, reading and writing the
+ * JBOD. The server keeps an I/O position per client, so every read must
+ * return the block its own client seeked to, whatever the other client did
+ * in between. */
+
+/* One step of the test: client |client| sends |cmd| with |disk| and
+ * |block| in the opcode; a write fills the block with |fill|, and a read
+ * must find it filled with |fill|. */
+typedef struct {
+  int client;
+  uint32_t cmd;
+  uint32_t disk;
+  uint32_t block;
+  uint8_t fill;
+} seek_step_t;
+
+#endif
@@ -10,6 +10,8 @@
 #include <fcntl.h>
 #include <err.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <time.h>
 
 #include "cache.h"
 #include "jbod.h"
@@ -17,21 +19,61 @@
 #include "util.h"
 #include "tester.h"
 #include "net.h"
+#include "capture.h"
+#include "trace.h"
+#include "mrc.h"
 
-#define TESTER_ARGUMENTS "hw:s:"
-#define USAGE                                               \
-  "USAGE: test [-h] [-w workload-file] [-s cache_size] \n"  \
-  "\n"                                                      \
-  "where:\n"                                                \
-  "    -h - help mode (display this message)\n"             \
-  "\n"                                                      \
+#define TESTER_ARGUMENTS "hw:s:S:g:t:c:Te:M:X:"
+#define USAGE                                                                 \
+  "USAGE: test [-h] [-w workload-file] [-s cache_size] [-S shm_name] [-g E:D:B]\n" \
+  "            [-t tcp|unix|shm] [-c capture-file] [-T] [-e event-trace]\n"   \
+  "            [-M sample-rate] [-X capabilities]\n"                        \
+  "\n"                                                                        \
+  "where:\n"                                                                  \
+  "    -h - help mode (display this message)\n"                               \
+  "    -S - share the cache with other processes through this shared-memory\n" \
+  "         segment, created with cache_size entries if it does not exist\n"  \
+  "    -g - geometry of E enclosures of D disks of B blocks (default 1:16:256);\n" \
+  "         enclosure i is served at port JBOD_PORT + i\n"                    \
+  "    -t - transport to the server (default tcp); enclosure i > 0 appends\n" \
+  "         .i to JBOD_UNIX_PATH or JBOD_SHM_NAME\n"                          \
+  "    -c - record every mdadm call to capture-file as a replayable trace\n"   \
+  "    -T - replay a captured workload at the pace it was recorded\n"        \
+  "    -e - record binary hot-path events to event-trace (see trace_decode)\n" \
+  "    -M - estimate the hit rate of every cache size from the queries of\n"  \
+  "         this run, sampling this share of the blocks; needs -s\n"       \
+  "    -X - use only these JBOD_CAP_* protocol extensions of the server\n"   \
+  "         (a bit mask, default all)\n"                                     \
+  "\n"                                                                        \
 
-int run_workload(char *workload, int cache_size);
+int run_workload(char *workload, int cache_size, const char *shared_cache,
+                 const mdadm_geometry_t *geometry, const char *capture, bool paced);
+
+/* Connects enclosure |i| over |transport|, each enclosure at its own endpoint */
+static bool connect_enclosure(uint32_t i, const char *transport) {
+  char name[128];
+
+  if (strcmp(transport, "tcp") == 0)
+    return jbod_connect_enclosure(i, JBOD_SERVER, JBOD_PORT + i);
+
+  bool is_unix = strcmp(transport, "unix") == 0;
+  if (!is_unix && strcmp(transport, "shm") != 0)
+    errx(1, "Unknown transport [%s], aborting.", transport);
+  const char *base = is_unix ? JBOD_UNIX_PATH : JBOD_SHM_NAME;
+  if (i == 0)
+    snprintf(name, sizeof(name), "%s", base);
+  else
+    snprintf(name, sizeof(name), "%s.%u", base, i);
+  return is_unix ? jbod_connect_unix(i, name) : jbod_connect_shm(i, name);
+}
 
 int main(int argc, char *argv[])
 {
   int ch, cache_size = 0;
-  char *workload = NULL;
+  char *workload = NULL, *transport = "tcp", *capture = NULL, *events = NULL;
+  char *shared_cache = NULL;
+  bool paced = false;
+  mdadm_geometry_t geometry = {1, JBOD_NUM_DISKS, JBOD_NUM_BLOCKS_PER_DISK};
 
   while ((ch = getopt(argc, argv, TESTER_ARGUMENTS)) != -1) {
     switch (ch) {
@@ -41,9 +83,37 @@ int main(int argc, char *argv[])
       case 's':
         cache_size = atoi(optarg);
         break;
+      case 'S':
+        shared_cache = optarg;
+        break;
       case 'w':
         workload = optarg;
         break;
+      case 't':
+        transport = optarg;
+        break;
+      case 'c':
+        capture = optarg;
+        break;
+      case 'T':
+        paced = true;
+        break;
+      case 'e':
+        events = optarg;
+        break;
+      case 'M':
+        if (mrc_start(atof(optarg)) != 1)
+          errx(1, "Bad sample rate [%s], aborting.", optarg);
+        break;
+      case 'X':
+        jbod_set_capability_mask(strtoul(optarg, NULL, 0));
+        break;
+      case 'g':
+        if (sscanf(optarg, "%u:%u:%u", &geometry.num_enclosures,
+                   &geometry.disks_per_enclosure, &geometry.blocks_per_disk) != 3 ||
+            mdadm_set_geometry(&geometry) != 1)
+          errx(1, "Bad geometry [%s], aborting.", optarg);
+        break;
       default:
         fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
         return -1;
@@ -55,10 +125,15 @@ int main(int argc, char *argv[])
     return -1;
   }
 
-  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
-    return -1;
+  for (uint32_t i = 0; i < geometry.num_enclosures; ++i)
+    if (!connect_enclosure(i, transport))
+      return -1;
   
-  run_workload(workload, cache_size);
+  if (events && trace_start(events) != 1)
+    err(1, "Cannot open event trace %s", events);
+  run_workload(workload, cache_size, shared_cache, &geometry, capture, paced);
+  if (events)
+    trace_stop();
   jbod_disconnect();
 
   return 0;
@@ -80,10 +155,35 @@ uint32_t op = 0;
   return op;
 }
 
-int run_workload(char *workload, int cache_size) {
+/* Sleeps until the start time in the timing columns of a captured line, if
+ * it has them; |skip| is the number of fields that precede that column. */
+static void pace(const char *line, int skip, uint64_t replay_start) {
+  const char *p = line;
+  uint64_t start, now;
+
+  for (int i = 0; i < skip; ++i) {
+    p = strchr(p, ' ');
+    if (!p)
+      return;
+    while (*p == ' ')
+      ++p;
+  }
+  if (sscanf(p, "%" SCNu64, &start) != 1)
+    return;
+
+  now = capture_now() - replay_start;
+  if (start > now) {
+    struct timespec ts = { (start - now) / 1000000000, (start - now) % 1000000000 };
+    nanosleep(&ts, NULL);
+  }
+}
+
+int run_workload(char *workload, int cache_size, const char *shared_cache,
+                 const mdadm_geometry_t *geometry, const char *capture, bool paced) {
   char line[256], cmd[32];
   uint8_t buf[MAX_IO_SIZE];
-  uint32_t addr, len, ch;
+  uint64_t addr;
+  uint32_t len, ch;
   int rc;
 
   memset(buf, 0, MAX_IO_SIZE);
@@ -93,32 +193,48 @@ int run_workload(char *workload, int cache_size) {
     err(1, "Cannot open workload file %s", workload);
 
   if (cache_size) {
-    rc = cache_create(cache_size);
+    if (shared_cache)
+      rc = cache_create_shared(shared_cache, cache_size);
+    else
+      rc = cache_create(cache_size);
     if (rc != 1)
       errx(1, "Failed to create cache.");
   }
 
+  if (capture && capture_start(capture) != 1)
+    err(1, "Cannot open capture file %s", capture);
+
+  uint64_t replay_start = capture_now();
   int line_num = 0;
   while (fgets(line, 256, f)) {
     ++line_num;
     line[strlen(line)-1] = '\0';
     if (equals(line, "MOUNT")) {
+      if (paced)
+        pace(line, 1, replay_start);
       rc = mdadm_mount();
     } else if (equals(line, "UNMOUNT")) {
+      if (paced)
+        pace(line, 1, replay_start);
       rc = mdadm_unmount();
     } else if (equals(line, "SIGNALL")) {
-      for (int i = 0; i < JBOD_NUM_DISKS; ++i)
-        for (int j = 0; j < JBOD_NUM_BLOCKS_PER_DISK; ++j) {
-          uint8_t b[JBOD_BLOCK_SIZE];
-          jbod_client_operation(encode_op(JBOD_SIGN_BLOCK, i, j), b);
-          fprintf(stdout, "%s", b);
-        }
+      for (uint32_t e = 0; e < geometry->num_enclosures; ++e)
+        for (int i = 0; i < geometry->disks_per_enclosure; ++i)
+          for (int j = 0; j < geometry->blocks_per_disk; ++j) {
+            uint8_t b[JBOD_BLOCK_SIZE];
+            jbod_enclosure_operation(e, encode_op(JBOD_SIGN_BLOCK, i, j), b);
+            fprintf(stdout, "%s", b);
+          }
     } else {
-      if (sscanf(line, "%7s %7u %4u %3u", cmd, &addr, &len, &ch) != 4)
+      if (sscanf(line, "%7s %" SCNu64 " %4u %3u", cmd, &addr, &len, &ch) != 4)
         errx(1, "Failed to parse command: [%s\n], aborting.", line);
+      if (paced)
+        pace(line, 4, replay_start);
       if (equals(cmd, "READ")) {
         rc = mdadm_read(addr, len, buf);
       } else if (equals(cmd, "WRITE")) {
+        if (ch == CAPTURE_MIXED_FILL)
+          errx(1, "Cannot replay the mixed data of captured write [%s] on line %d, aborting.", line, line_num);
         memset(buf, ch, len);
         rc = mdadm_write(addr, len, buf);
       } else {
@@ -131,11 +247,20 @@ int run_workload(char *workload, int cache_size) {
   }
   fclose(f);
 
+  if (capture)
+    capture_stop();
+
   if (cache_size)
     cache_destroy();
 
   jbod_print_cost();
   cache_print_hit_rate();
+  mdadm_print_write_stats();
+  jbod_print_net_stats();
+  if (mrc_enabled()) {
+    mrc_print();
+    mrc_stop();
+  }
 
   return 0;
 }
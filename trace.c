@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+/* Records per thread ring; must be a power of two */
+#define TRACE_RING_SIZE 8192
+
+/* How often the drainer empties the rings */
+#define TRACE_DRAIN_INTERVAL_NS 2000000
+
+/* A single-producer (the owning thread) single-consumer (the drainer) ring */
+typedef struct trace_ring {
+  _Atomic uint32_t head;
+  _Atomic uint32_t tail;
+  uint32_t id;
+  uint64_t dropped;
+  struct trace_ring *next;
+  trace_record_t records[TRACE_RING_SIZE];
+} trace_ring_t;
+
+volatile int trace_on = 0;
+
+static int trace_fd = -1;
+static pthread_t drainer;
+static volatile int drainer_stop = 0;
+
+/* Rings of every thread that ever traced; they are never freed, so a thread
+ * can keep its pointer across trace_start/trace_stop cycles. */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings = NULL;
+static uint32_t num_rings = 0;
+
+static _Thread_local trace_ring_t *my_ring = NULL;
+
+static const char *trace_event_text[TRACE_NUM_EVENTS] = {
+  "NET_OPERATION",
+  "CACHE_LOOKUP",
+  "CACHE_PIN",
+  "CACHE_INSERT",
+  "CACHE_UPDATE",
+  "MDADM_READ",
+  "MDADM_WRITE",
+};
+
+const char *trace_event_name(uint32_t event) {
+  if (event >= TRACE_NUM_EVENTS)
+    return "UNKNOWN";
+  return trace_event_text[event];
+}
+
+uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static trace_ring_t *register_ring(void) {
+  trace_ring_t *ring = calloc(1, sizeof(trace_ring_t));
+  if (ring == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&rings_lock);
+  ring->id = num_rings++;
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+  return ring;
+}
+
+void trace_emit(trace_event_t event, uint32_t op, uint32_t disk, uint32_t block, uint64_t start) {
+  uint64_t end = trace_now();
+
+  if (my_ring == NULL && (my_ring = register_ring()) == NULL)
+    return;
+
+  trace_ring_t *ring = my_ring;
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  /* Never block the traced thread: drop the event if the drainer is behind */
+  if (head - tail == TRACE_RING_SIZE) {
+    ring->dropped++;
+    return;
+  }
+
+  trace_record_t *rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+  rec->timestamp = start;
+  rec->duration = end - start;
+  rec->disk = disk;
+  rec->block = block;
+  rec->event = event;
+  rec->op = op;
+  rec->thread = ring->id;
+  rec->reserved = 0;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Writes out whatever each ring holds; only the drainer (or trace_stop once
+ * the drainer is gone) calls it. */
+static void drain(void) {
+  pthread_mutex_lock(&rings_lock);
+  for (trace_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    while (tail != head) {
+      /* Write the contiguous run up to the end of the array in one go */
+      uint32_t offset = tail & (TRACE_RING_SIZE - 1);
+      uint32_t n = head - tail;
+      if (n > TRACE_RING_SIZE - offset)
+        n = TRACE_RING_SIZE - offset;
+      if (write(trace_fd, &ring->records[offset], n * sizeof(trace_record_t)) == -1)
+        break;
+      tail += n;
+    }
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+  }
+  pthread_mutex_unlock(&rings_lock);
+}
+
+static void *drainer_thread(void *arg) {
+  struct timespec interval = { 0, TRACE_DRAIN_INTERVAL_NS };
+
+  while (!drainer_stop) {
+    nanosleep(&interval, NULL);
+    drain();
+  }
+  return NULL;
+}
+
+int trace_start(const char *path) {
+  if (trace_fd != -1)
+    return -1;
+
+  trace_fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  if (trace_fd == -1)
+    return -1;
+  if (write(trace_fd, TRACE_MAGIC, strlen(TRACE_MAGIC)) == -1) {
+    close(trace_fd);
+    trace_fd = -1;
+    return -1;
+  }
+
+  /* Events left over from an earlier session belong to a closed file */
+  pthread_mutex_lock(&rings_lock);
+  for (trace_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+    atomic_store(&ring->tail, atomic_load(&ring->head));
+    ring->dropped = 0;
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  drainer_stop = 0;
+  if (pthread_create(&drainer, NULL, drainer_thread, NULL) != 0) {
+    close(trace_fd);
+    trace_fd = -1;
+    return -1;
+  }
+  trace_on = 1;
+  return 1;
+}
+
+int trace_stop(void) {
+  uint64_t dropped = 0;
+
+  if (trace_fd == -1)
+    return -1;
+
+  trace_on = 0;
+  drainer_stop = 1;
+  pthread_join(drainer, NULL);
+  drain();
+
+  pthread_mutex_lock(&rings_lock);
+  for (trace_ring_t *ring = rings; ring != NULL; ring = ring->next)
+    dropped += ring->dropped;
+  pthread_mutex_unlock(&rings_lock);
+  if (dropped)
+    fprintf(stderr, "Trace: dropped %lu events\n", (unsigned long)dropped);
+
+  close(trace_fd);
+  trace_fd = -1;
+  return 1;
+}
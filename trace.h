@@ -0,0 +1,66 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Binary event tracing for the hot paths, where debug_log would cost a
+ * formatted write per message. Each thread appends fixed-size records to its
+ * own lock-free ring; a background thread drains the rings to the trace
+ * file, which trace_decode renders. When tracing is off a trace point costs
+ * one predictable branch on trace_on. */
+
+typedef enum {
+  TRACE_NET_OPERATION,   /* jbod_enclosure_operation; op is the JBOD command */
+  TRACE_CACHE_LOOKUP,    /* cache_lookup; op is 1 on a hit and 0 on a miss */
+  TRACE_CACHE_PIN,       /* cache_pin; op is 1 on a hit and 0 on a miss */
+  TRACE_CACHE_INSERT,    /* cache_insert; op is 1 on success and 0 on failure */
+  TRACE_CACHE_UPDATE,    /* cache_update */
+  TRACE_MDADM_READ,      /* one run of consecutive blocks of an mdadm_read,
+                            from its first block; op is the block count */
+  TRACE_MDADM_WRITE,     /* the same for an mdadm_write */
+  TRACE_NUM_EVENTS,
+} trace_event_t;
+
+/* One event as stored in the trace file, in host byte order. */
+typedef struct {
+  uint64_t timestamp;    /* start of the event, CLOCK_MONOTONIC nanoseconds */
+  uint32_t duration;     /* nanoseconds */
+  uint32_t disk;
+  uint32_t block;
+  uint16_t event;        /* trace_event_t */
+  uint16_t op;
+  uint32_t thread;       /* the ring the event went through */
+  uint32_t reserved;
+} trace_record_t;
+
+/* Every trace file starts with these bytes */
+#define TRACE_MAGIC "JBODTRC1"
+
+extern volatile int trace_on;
+
+/* Returns 1 on success and -1 on failure. Starts tracing to |path|. */
+int trace_start(const char *path);
+
+/* Returns 1 on success and -1 on failure. Drains every ring and closes the
+ * file; prints how many events were dropped because a ring was full. */
+int trace_stop(void);
+
+/* Returns a printable name for |event|. */
+const char *trace_event_name(uint32_t event);
+
+uint64_t trace_now(void);
+void trace_emit(trace_event_t event, uint32_t op, uint32_t disk, uint32_t block, uint64_t start);
+
+/* Timestamp for the start of a traced section; 0 without reading the clock
+ * when tracing is off. */
+#define TRACE_START() (__builtin_expect(trace_on, 0) ? trace_now() : 0)
+
+/* Records an event that began at |start| (from TRACE_START) and ends now. */
+#define TRACE_END(event, op, disk, block, start)                      \
+  do {                                                                \
+    if (__builtin_expect(trace_on, 0) && (start) != 0)                \
+      trace_emit((event), (op), (disk), (block), (start));           \
+  } while (0)
+
+#endif
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "jbod.h"
+#include "net.h"
+#include "trace.h"
+#include "trace_decode.h"
+
+#define DECODE_ARGUMENTS "hs"
+#define USAGE                                               \
+  "USAGE: trace_decode [-h] [-s] trace-file\n"              \
+  "\n"                                                      \
+  "where:\n"                                                \
+  "    -h - help mode (display this message)\n"             \
+  "    -s - print per-event totals instead of every event\n" \
+  "\n"                                                      \
+
+/* The JBOD commands, then the protocol extensions of net.h */
+#define NUM_CMD_TEXT (JBOD_INVALIDATE + 1)
+
+static const char *cmd_text[NUM_CMD_TEXT] = {
+  "MOUNT", "UNMOUNT", "SEEK_TO_DISK", "SEEK_TO_BLOCK",
+  "READ_BLOCK", "WRITE_BLOCK", "SIGN_BLOCK",
+  [JBOD_HELLO] = "HELLO",
+  [JBOD_READ_EXTENT] = "READ_EXTENT",
+  [JBOD_WRITE_EXTENT] = "WRITE_EXTENT",
+  [JBOD_WRITE_PARTIAL] = "WRITE_PARTIAL",
+  [JBOD_SUBSCRIBE] = "SUBSCRIBE",
+  [JBOD_INVALIDATE] = "INVALIDATE",
+};
+
+int trace_decode(FILE *in, FILE *out, bool summary) {
+  char magic[sizeof(TRACE_MAGIC) - 1];
+  trace_record_t rec;
+  uint64_t first = 0, count[TRACE_NUM_EVENTS + 1] = {0};
+  uint64_t total_ns[TRACE_NUM_EVENTS + 1] = {0}, max_ns[TRACE_NUM_EVENTS + 1] = {0};
+
+  if (fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+    return -1;
+
+  if (!summary)
+    fprintf(out, "%12s %6s %-14s %-14s %5s %5s %10s\n",
+            "time(us)", "thread", "event", "op", "disk", "block", "dur(ns)");
+
+  while (fread(&rec, sizeof(rec), 1, in) == 1) {
+    uint32_t e = rec.event < TRACE_NUM_EVENTS ? rec.event : TRACE_NUM_EVENTS;
+
+    count[e]++;
+    total_ns[e] += rec.duration;
+    if (rec.duration > max_ns[e])
+      max_ns[e] = rec.duration;
+    if (summary)
+      continue;
+
+    /* Rings drain one after another, so events are not globally sorted; the
+     * first record still anchors the time axis. */
+    if (first == 0)
+      first = rec.timestamp;
+    char op[16];
+    if (rec.event == TRACE_NET_OPERATION && rec.op < NUM_CMD_TEXT)
+      snprintf(op, sizeof(op), "%s", cmd_text[rec.op]);
+    else
+      snprintf(op, sizeof(op), "%u", rec.op);
+    fprintf(out, "%12.3f %6u %-14s %-14s %5u %5u %10u\n",
+            ((int64_t)(rec.timestamp - first)) / 1000.0, rec.thread,
+            trace_event_name(rec.event), op, rec.disk, rec.block, rec.duration);
+  }
+
+  if (summary) {
+    fprintf(out, "%-14s %10s %12s %12s\n", "event", "count", "mean(ns)", "max(ns)");
+    for (int e = 0; e <= TRACE_NUM_EVENTS; ++e)
+      if (count[e])
+        fprintf(out, "%-14s %10lu %12.1f %12lu\n", trace_event_name(e),
+                (unsigned long)count[e], (double)total_ns[e] / count[e], (unsigned long)max_ns[e]);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  bool summary = false;
+  int ch;
+
+  while ((ch = getopt(argc, argv, DECODE_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 's':
+        summary = true;
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  if (optind >= argc) {
+    fprintf(stderr, USAGE);
+    return -1;
+  }
+
+  FILE *in = fopen(argv[optind], "rb");
+  if (!in)
+    err(1, "Cannot open trace file %s", argv[optind]);
+  if (trace_decode(in, stdout, summary) != 0)
+    errx(1, "%s is not a trace file", argv[optind]);
+  fclose(in);
+  return 0;
+}
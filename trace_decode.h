@@ -0,0 +1,13 @@
+#ifndef TRACE_DECODE_H_
+#define TRACE_DECODE_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/* Renders the binary trace read from |in| to |out|, one event per line with
+ * times relative to the first event, or with |summary| one line per event
+ * type with its count and mean and maximum duration. Returns 0 on success
+ * and -1 if |in| is not a trace. */
+int trace_decode(FILE *in, FILE *out, bool summary);
+
+#endif
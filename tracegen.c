@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <err.h>
+
+#include "jbod.h"
+#include "util.h"
+#include "tester.h"
+#include "tracegen.h"
+
+#define TRACEGEN_ARGUMENTS "hn:r:S:z:H:i:a:x:po:"
+#define USAGE                                                                   \
+  "USAGE: tracegen [-h] -o prefix [-n ops] [-r read_pct] [-S seq_pct]\n"        \
+  "                [-z skew] [-H hot_blocks] [-i min:max] [-a align_pct]\n"     \
+  "                [-x cross_pct] [-p]\n"                                       \
+  "\n"                                                                          \
+  "where:\n"                                                                    \
+  "    -h - help mode (display this message)\n"                                 \
+  "    -o - write prefix-input and prefix-expected-output\n"                    \
+  "    -n - number of READ/WRITE operations (default 10000)\n"                  \
+  "    -r - percentage of reads (default 30)\n"                                 \
+  "    -S - percentage of I/Os continuing the previous one (default 0)\n"       \
+  "    -z - Zipfian skew over the hot set, 0 is uniform (default 0)\n"          \
+  "    -H - number of distinct blocks touched (default all blocks)\n"           \
+  "    -i - I/O size range in bytes (default 1:1024)\n"                         \
+  "    -a - percentage of block aligned, block sized I/Os (default 0)\n"        \
+  "    -x - percentage of I/Os crossing a disk boundary (default 0)\n"          \
+  "    -p - prefill every block before the workload\n"                          \
+  "\n"                                                                          \
+
+#define NUM_BLOCKS  (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+#define DEVICE_SIZE (JBOD_NUM_DISKS * JBOD_DISK_SIZE)
+
+/* Resolution of the uniform variate used to sample the Zipfian CDF */
+#define UNIT_STEPS  (1u << 30)
+
+static uint32_t encode_op(jbod_cmd_t cmd, int disk_num, int block_num) {
+  return (cmd << 14) | (disk_num << 28) | (block_num << 20);
+}
+
+static double rand_unit(void) {
+  return (double)get_rand(0, UNIT_STEPS - 1) / UNIT_STEPS;
+}
+
+static int rand_pct(uint32_t pct) {
+  return get_rand(0, 99) < pct;
+}
+
+/* Applies a write to the in-process reference JBOD the same way mdadm does,
+ * one read-modify-write per block, so its signatures are the expected output. */
+static void reference_write(uint32_t addr, uint32_t len, uint8_t ch) {
+  uint8_t block[JBOD_BLOCK_SIZE];
+
+  while (len > 0) {
+    int disk = addr / JBOD_DISK_SIZE;
+    int blk = (addr % JBOD_DISK_SIZE) / JBOD_BLOCK_SIZE;
+    uint32_t offset = addr % JBOD_BLOCK_SIZE;
+    uint32_t n = JBOD_BLOCK_SIZE - offset;
+    if (n > len)
+      n = len;
+
+    jbod_operation(encode_op(JBOD_SEEK_TO_DISK, disk, 0), NULL);
+    jbod_operation(encode_op(JBOD_SEEK_TO_BLOCK, 0, blk), NULL);
+    jbod_operation(encode_op(JBOD_READ_BLOCK, 0, 0), block);
+    memset(block + offset, ch, n);
+    jbod_operation(encode_op(JBOD_SEEK_TO_BLOCK, 0, blk), NULL);
+    jbod_operation(encode_op(JBOD_WRITE_BLOCK, 0, 0), block);
+
+    addr += n;
+    len -= n;
+  }
+}
+
+static void emit_write(FILE *input, uint32_t addr, uint32_t len, uint8_t ch) {
+  fprintf(input, "WRITE %u %u %u\n", addr, len, ch);
+  reference_write(addr, len, ch);
+}
+
+/* Builds the cumulative distribution of a Zipfian law with |skew| over |n| ranks. */
+static double *zipf_cdf(uint32_t n, double skew) {
+  double *cdf = malloc(n * sizeof(double));
+  if (cdf == NULL)
+    return NULL;
+
+  double sum = 0;
+  for (uint32_t k = 0; k < n; ++k) {
+    sum += 1.0 / pow(k + 1, skew);
+    cdf[k] = sum;
+  }
+  for (uint32_t k = 0; k < n; ++k)
+    cdf[k] /= sum;
+  return cdf;
+}
+
+static uint32_t zipf_sample(const double *cdf, uint32_t n) {
+  double u = rand_unit();
+  uint32_t lo = 0, hi = n - 1;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Number of whole blocks in the smallest and largest aligned I/O that fit
+ * the I/O size range; none fits when |lo| exceeds |hi|. */
+static void aligned_blocks(const tracegen_params_t *p, uint32_t *lo, uint32_t *hi) {
+  *lo = (p->min_io + JBOD_BLOCK_SIZE - 1) / JBOD_BLOCK_SIZE;
+  *hi = p->max_io / JBOD_BLOCK_SIZE;
+}
+
+int tracegen_check_params(const tracegen_params_t *p) {
+  uint32_t lo, hi;
+
+  if (p->hot_blocks < 1 || p->hot_blocks > NUM_BLOCKS || p->min_io < 1 ||
+      p->min_io > p->max_io || p->max_io > MAX_IO_SIZE)
+    return -1;
+  /* Aligned I/Os are whole blocks, so one must fit in the size range */
+  aligned_blocks(p, &lo, &hi);
+  if (p->align_pct > 0 && lo > hi)
+    return -1;
+  return 0;
+}
+
+int tracegen_generate(const tracegen_params_t *p, FILE *input, FILE *expected) {
+  uint32_t hot[NUM_BLOCKS];
+  uint32_t next_addr = 0;
+  uint8_t sig[JBOD_BLOCK_SIZE];
+
+  if (tracegen_check_params(p) != 0)
+    return -1;
+
+  /* The hot set is a random subset of blocks, hottest first, so skewed
+   * workloads do not simply hammer the beginning of disk 0. */
+  for (uint32_t i = 0; i < NUM_BLOCKS; ++i)
+    hot[i] = i;
+  for (uint32_t i = NUM_BLOCKS - 1; i > 0; --i) {
+    uint32_t j = get_rand(0, i);
+    uint32_t t = hot[i];
+    hot[i] = hot[j];
+    hot[j] = t;
+  }
+
+  double *cdf = zipf_cdf(p->hot_blocks, p->skew);
+  if (cdf == NULL)
+    return -1;
+
+  jbod_operation(encode_op(JBOD_MOUNT, 0, 0), NULL);
+  fprintf(input, "MOUNT\n");
+
+  if (p->prefill)
+    for (uint32_t b = 0; b < NUM_BLOCKS; ++b)
+      emit_write(input, b * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, get_rand(0, 255));
+
+  for (uint32_t i = 0; i < p->num_ops; ++i) {
+    uint32_t len, addr;
+
+    if (rand_pct(p->align_pct)) {
+      uint32_t lo, hi;
+      aligned_blocks(p, &lo, &hi);
+      len = get_rand(lo, hi) * JBOD_BLOCK_SIZE;
+      addr = hot[zipf_sample(cdf, p->hot_blocks)] * JBOD_BLOCK_SIZE;
+    } else {
+      len = get_rand(p->min_io, p->max_io);
+      addr = hot[zipf_sample(cdf, p->hot_blocks)] * JBOD_BLOCK_SIZE +
+             get_rand(0, JBOD_BLOCK_SIZE - 1);
+    }
+
+    if (i > 0 && rand_pct(p->seq_pct)) {
+      /* Sequential runs wrap around to the start of the device */
+      addr = (next_addr + len > DEVICE_SIZE) ? 0 : next_addr;
+    } else if (len > 1 && rand_pct(p->cross_pct)) {
+      uint32_t disk = get_rand(1, JBOD_NUM_DISKS - 1);
+      addr = disk * JBOD_DISK_SIZE - get_rand(1, len - 1);
+    } else if (addr + len > DEVICE_SIZE) {
+      addr = DEVICE_SIZE - len;
+    }
+
+    if (rand_pct(p->read_pct))
+      fprintf(input, "READ %u %u 0\n", addr, len);
+    else
+      emit_write(input, addr, len, get_rand(0, 255));
+    next_addr = addr + len;
+  }
+
+  fprintf(input, "SIGNALL\n");
+  for (int d = 0; d < JBOD_NUM_DISKS; ++d)
+    for (int b = 0; b < JBOD_NUM_BLOCKS_PER_DISK; ++b) {
+      jbod_operation(encode_op(JBOD_SIGN_BLOCK, d, b), sig);
+      fprintf(expected, "%s", sig);
+    }
+  fprintf(input, "UNMOUNT\n");
+  jbod_operation(encode_op(JBOD_UNMOUNT, 0, 0), NULL);
+
+  free(cdf);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  tracegen_params_t params = {
+    .num_ops = 10000,
+    .read_pct = 30,
+    .seq_pct = 0,
+    .skew = 0,
+    .hot_blocks = NUM_BLOCKS,
+    .min_io = 1,
+    .max_io = MAX_IO_SIZE,
+    .align_pct = 0,
+    .cross_pct = 0,
+    .prefill = 0,
+  };
+  char *prefix = NULL, path[4096];
+  int ch;
+
+  while ((ch = getopt(argc, argv, TRACEGEN_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'n':
+        params.num_ops = atoi(optarg);
+        break;
+      case 'r':
+        params.read_pct = atoi(optarg);
+        break;
+      case 'S':
+        params.seq_pct = atoi(optarg);
+        break;
+      case 'z':
+        params.skew = atof(optarg);
+        break;
+      case 'H':
+        params.hot_blocks = atoi(optarg);
+        break;
+      case 'i':
+        if (sscanf(optarg, "%u:%u", &params.min_io, &params.max_io) != 2)
+          errx(1, "Bad I/O size range [%s], expected min:max.", optarg);
+        break;
+      case 'a':
+        params.align_pct = atoi(optarg);
+        break;
+      case 'x':
+        params.cross_pct = atoi(optarg);
+        break;
+      case 'p':
+        params.prefill = 1;
+        break;
+      case 'o':
+        prefix = optarg;
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  if (!prefix) {
+    fprintf(stderr, USAGE);
+    return -1;
+  }
+  /* Checked before the files are created, so a bad command line leaves none behind */
+  if (tracegen_check_params(&params) != 0)
+    errx(1, "Invalid workload parameters.");
+
+  snprintf(path, sizeof(path), "%s-input", prefix);
+  FILE *input = fopen(path, "w");
+  if (!input)
+    err(1, "Cannot open trace file %s", path);
+  snprintf(path, sizeof(path), "%s-expected-output", prefix);
+  FILE *expected = fopen(path, "w");
+  if (!expected)
+    err(1, "Cannot open expected output file %s", path);
+
+  if (tracegen_generate(&params, input, expected) != 0)
+    errx(1, "Failed to generate the workload.");
+
+  fclose(input);
+  fclose(expected);
+  return 0;
+}
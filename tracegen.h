@@ -0,0 +1,31 @@
+#ifndef TRACEGEN_H_
+#define TRACEGEN_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Knobs of a synthetic workload; see the USAGE text in tracegen.c. */
+typedef struct {
+  uint32_t num_ops;       /* number of READ/WRITE lines to emit */
+  uint32_t read_pct;      /* percentage of operations that are reads */
+  uint32_t seq_pct;       /* chance an I/O continues where the previous one ended */
+  double skew;            /* Zipfian skew of the hot set; 0 means uniform */
+  uint32_t hot_blocks;    /* number of distinct blocks the workload touches */
+  uint32_t min_io;        /* smallest I/O size in bytes */
+  uint32_t max_io;        /* largest I/O size in bytes */
+  uint32_t align_pct;     /* chance an I/O is block aligned and block sized */
+  uint32_t cross_pct;     /* chance an I/O straddles a disk boundary */
+  int prefill;            /* write every block once before the workload */
+} tracegen_params_t;
+
+/* Returns 0 if |params| describe a workload tracegen_generate can produce,
+ * and -1 otherwise: an empty or oversized hot set, a bad I/O size range, or
+ * aligned I/Os requested when no whole block fits in that range. */
+int tracegen_check_params(const tracegen_params_t *params);
+
+/* Writes the workload described by |params| in the traces/ text format to
+ * |input|, and the SIGNALL output the tester must produce for it to
+ * |expected|. Returns 0 on success and -1 on failure. */
+int tracegen_generate(const tracegen_params_t *params, FILE *input, FILE *expected);
+
+#endif
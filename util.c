@@ -50,8 +50,7 @@ uint32_t get_rand(uint32_t min, uint32_t max) {
   int rc = RAND_bytes((uint8_t *)&v, sizeof(v));
   assert(rc);
 
-  v = (uint32_t)(v/(UINT32_MAX/(max - min + 1))) + min;
-  if (v == max+1)
-    v = max;
-  return v;
+  /* Scale into [min, max] with a 64-bit multiply; dividing by the range
+   * overshoots max for ranges that are not small relative to 2^32. */
+  return min + (uint32_t)(((uint64_t)v * ((uint64_t)max - min + 1)) >> 32);
 }